@@ -0,0 +1,113 @@
+/* Checks that stateful expressions never share state between owners.
+ * Two parameters with the same stateful text each get their own call site
+ * state from expression_cache, while pure text is still compiled once.
+ *
+ * Exits non zero when a check fails. */
+
+#include "../expression-cache.hpp"
+#include "../tinyexpr.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <memory>
+#include <vector>
+
+/* Stands in for ExpressionState and state_smooth in obs-shader-filter.cpp */
+struct test_slot {
+	uint64_t frame;
+	double   value;
+	double   last;
+};
+
+struct test_state {
+	uint64_t                                frame = 0;
+	std::vector<std::unique_ptr<test_slot>> slots;
+
+	static void *allocate(void *arena, size_t size)
+	{
+		(void)size;
+		test_state *state = static_cast<test_state *>(arena);
+		state->slots.emplace_back(new test_slot{UINT64_MAX, 0, 0});
+		return state->slots.back().get();
+	}
+};
+
+static test_state         state;
+static te_state_allocator allocator = { test_state::allocate, &state, sizeof(test_slot) };
+static double             x = 0;
+
+static double test_smooth(void *context, double value, double rate)
+{
+	test_slot *slot = static_cast<test_slot *>(context);
+	if (slot->frame == UINT64_MAX)
+		slot->value = value;
+	if (slot->frame != state.frame) {
+		slot->last = slot->value;
+		slot->frame = state.frame;
+	}
+	slot->value = slot->last + (value - slot->last) * rate;
+	return slot->value;
+}
+
+/* Sorted by name, tinyexpr binary searches its lookup */
+static const te_variable test_vars[] = {
+	{"smooth", reinterpret_cast<const void *>(&test_smooth), TE_CLOSURE2 | TE_FLAG_STATEFUL, &allocator},
+	{"x", &x, TE_VARIABLE, nullptr},
+};
+
+/* Mirrors TinyExpr::compile */
+static te_expr *compile(expression_cache<te_expr> &cache, const std::string &expression, const void *owner)
+{
+	te_expr *compiled = nullptr;
+	if (cache.find(expression, owner, compiled))
+		return compiled;
+	int err = 0;
+	compiled = te_compile(expression.c_str(), test_vars, sizeof(test_vars) / sizeof(test_vars[0]), &err);
+	cache.insert(expression, owner, compiled, te_is_stateful(compiled) != 0);
+	return compiled;
+}
+
+static int failures = 0;
+
+static void check(bool ok, const char *what)
+{
+	if (!ok) {
+		fprintf(stderr, "FAILED: %s\n", what);
+		failures++;
+	}
+}
+
+int main()
+{
+	expression_cache<te_expr> cache(te_free);
+
+	/* Two parameters whose expressions have identical text */
+	std::string a = "smooth(x, 0.5)";
+	std::string b = "smooth(x, 0.5)";
+
+	te_expr *ea = compile(cache, a, &a);
+	te_expr *eb = compile(cache, b, &b);
+	check(ea && eb, "stateful expressions compile");
+	check(ea != eb, "owners get their own stateful expression");
+	check(compile(cache, a, &a) == ea, "an owner finds its own expression again");
+	check(state.slots.size() == 2, "one slot per owner");
+
+	std::string pa = "x + 1";
+	std::string pb = "x + 1";
+	check(compile(cache, pa, &pa) == compile(cache, pb, &pb), "pure expressions are shared by text");
+	check(state.slots.size() == 2, "pure expressions allocate no state");
+
+	/* a follows 0 and b follows 10, each smoothing only its own history */
+	for (state.frame = 1; state.frame <= 4; state.frame++) {
+		x = 0;
+		double va = te_eval(compile(cache, a, &a));
+		x = 10;
+		double vb = te_eval(compile(cache, b, &b));
+		check(va == 0, "a keeps its own history");
+		check(vb == 10, "b keeps its own history");
+	}
+
+	if (!failures)
+		printf("expression-test passed\n");
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,190 @@
+/* Headless benchmark of the particle simulation, needs neither OBS nor a GPU.
+ * Drives the same code TextureData::videoTick does: expression spawn, age and
+ * integrate with culling, depth sort and the instance stream fill. The fill
+ * writes into memory standing in for the mapped instance texture.
+ *
+ * particle-bench [--frames n] [--threads n] [particles...]
+ *
+ * Prints ns/particle per stage and exits non zero when a stage's output is wrong. */
+
+#include "../particles.hpp"
+#include "../tinyexpr.h"
+#include "../mtrandom.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <vector>
+
+static const double pi = 3.14159265358979323846;
+
+/* Sorted by name, tinyexpr binary searches its lookup */
+static const te_variable bench_funcs[] = {
+	{"cos", reinterpret_cast<const void *>(static_cast<double (*)(double)>(&cos)), TE_FUNCTION1 | TE_FLAG_PURE, nullptr},
+	{"pi", &pi, TE_VARIABLE, nullptr},
+	{"random", reinterpret_cast<const void *>(&random_double), TE_FUNCTION2, nullptr},
+	{"sin", reinterpret_cast<const void *>(static_cast<double (*)(double)>(&sin)), TE_FUNCTION1 | TE_FLAG_PURE, nullptr},
+};
+
+/* A fountain, in the order generateParticle evaluates an emitter's expressions:
+ * emitter x, y, z, emitter rotation x, y, z, rotate x, y, z, translate x, y, z,
+ * particle_sec, alpha, alpha_decay, frame. Empty ones take the default. */
+static const char *bench_emitter[16] = {
+	"random(-0.5, 0.5)", "random(0.8, 1)", "", "", "", "random(0, 1)",
+	"", "", "random(-90, 90)", "random(-0.1, 0.1)", "random(-0.3, -0.1)", "",
+	"60", "random(128, 255)", "random(0, 2)", "random(0, 16)"
+};
+static const double bench_defaults[16] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 255, 0, 0 };
+
+typedef std::chrono::steady_clock bench_clock;
+
+static double elapsed_ns(bench_clock::time_point start)
+{
+	return (double)std::chrono::duration_cast<std::chrono::nanoseconds>(bench_clock::now() - start).count();
+}
+
+struct benchResult {
+	double spawn = 0;
+	double simulate = 0;
+	double sort = 0;
+	double fill = 0;
+	bool   ok = true;
+};
+
+/* Mirrors TextureData::generateParticle */
+static void spawn_particles(particleSystem &system, te_expr **exprs, size_t count, float rate)
+{
+	for (size_t i = 0; i < count; i++) {
+		double v[16];
+		for (size_t k = 0; k < 16; k++)
+			v[k] = exprs[k] ? te_eval(exprs[k]) : bench_defaults[k];
+		float position[PARTICLE_AFFINE_SIZE];
+		float transform[PARTICLE_AFFINE_SIZE];
+		particle_affine_compose(position, v[0], v[1], v[2], v[3], v[4], v[5], rate);
+		particle_affine_compose(transform, v[6] * rate, v[7] * rate, v[8] * rate, v[9], v[10], v[11], rate);
+		system.spawn(position, transform, v[13], v[14], v[12], 0, v[15], 16);
+	}
+}
+
+static bool check_order(const particleSystem &system, const std::vector<uint32_t> &order, size_t visible)
+{
+	size_t count = system.particles.size();
+	if (order.size() != count)
+		return false;
+	std::vector<uint8_t> seen(count, 0);
+	for (size_t i = 0; i < count; i++) {
+		uint32_t p = order[i];
+		if (p >= count || seen[p] || (i < visible) != (system.visible[p] != 0))
+			return false;
+		seen[p] = 1;
+		if (i > 0 && i < visible && system.particles.z[order[i - 1]] < system.particles.z[p])
+			return false;
+	}
+	return true;
+}
+
+static bool check_fill(const std::vector<float> &instances, size_t visible, const float *bounds)
+{
+	for (size_t i = 0; i < visible; i++) {
+		const float *o = &instances[i * PARTICLE_INSTANCE_SIZE];
+		if (o[0] < bounds[0] || o[1] < bounds[1] || o[0] > bounds[2] || o[1] > bounds[3])
+			return false;
+	}
+	return true;
+}
+
+static benchResult run(ParticleThreadPool &pool, te_expr **exprs, size_t count, size_t frames)
+{
+	benchResult result;
+	const float rate = 1.0f / 60.0f;
+
+	/* Nothing despawns so every frame sees the same population */
+	particleSystem system;
+	system.setCapacity(count);
+	system.despawnOld = false;
+	system.despawnOutOfView = false;
+	ParticleSimulation simulation(&pool);
+	simulation.add(&system);
+
+	bench_clock::time_point start = bench_clock::now();
+	spawn_particles(system, exprs, count, rate);
+	result.spawn = elapsed_ns(start);
+
+	std::vector<uint32_t> order;
+	std::vector<particle_sort_key> scratch;
+	std::vector<float> instances(count * PARTICLE_INSTANCE_SIZE);
+	float bounds[4];
+	for (size_t frame = 0; frame < frames; frame++) {
+		start = bench_clock::now();
+		simulation.step(frame, rate, rate);
+		result.simulate += elapsed_ns(start);
+
+		start = bench_clock::now();
+		size_t visible = system.drawOrder(order, scratch, true);
+		result.sort += elapsed_ns(start);
+
+		start = bench_clock::now();
+		particle_fill_instances(&pool, system.particles, order.data(), order.size(), visible,
+				instances.data(), bounds);
+		result.fill += elapsed_ns(start);
+
+		if (!check_order(system, order, visible) || !check_fill(instances, visible, bounds))
+			result.ok = false;
+	}
+	simulation.remove(&system);
+
+	result.spawn /= count;
+	result.simulate /= (double)count * frames;
+	result.sort /= (double)count * frames;
+	result.fill /= (double)count * frames;
+	return result;
+}
+
+int main(int argc, char **argv)
+{
+	size_t frames = 10;
+	size_t threads = std::thread::hardware_concurrency();
+	std::vector<size_t> counts;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc)
+			frames = strtoul(argv[++i], nullptr, 10);
+		else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+			threads = strtoul(argv[++i], nullptr, 10);
+		else
+			counts.push_back(strtoul(argv[i], nullptr, 10));
+	}
+	if (counts.empty())
+		counts = { 1000, 10000, 100000, 1000000 };
+	frames = frames ? frames : 1;
+	threads = threads ? threads : 1;
+
+	te_expr *exprs[16];
+	for (size_t k = 0; k < 16; k++) {
+		int err = 0;
+		exprs[k] = *bench_emitter[k] ? te_compile(bench_emitter[k], bench_funcs,
+				sizeof(bench_funcs) / sizeof(bench_funcs[0]), &err) : nullptr;
+		if (*bench_emitter[k] && !exprs[k]) {
+			fprintf(stderr, "failed to compile \"%s\" at %d\n", bench_emitter[k], err);
+			return 1;
+		}
+	}
+
+	ParticleThreadPool pool(threads);
+	printf("%zu threads, %zu frames, ns/particle\n", pool.threads(), frames);
+	printf("%10s %10s %10s %10s %10s\n", "particles", "spawn", "simulate", "sort", "fill");
+	int status = 0;
+	for (size_t count : counts) {
+		if (!count)
+			continue;
+		benchResult r = run(pool, exprs, count, frames);
+		printf("%10zu %10.2f %10.2f %10.2f %10.2f%s\n", count, r.spawn, r.simulate, r.sort, r.fill,
+				r.ok ? "" : "  FAILED");
+		if (!r.ok)
+			status = 1;
+	}
+
+	for (size_t k = 0; k < 16; k++)
+		te_free(exprs[k]);
+	return status;
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <string>
+#include <unordered_map>
+
+/* Compiled expressions looked up by their text. Expressions calling a stateful
+ * function are kept per owner instead, so two owners with the same text never
+ * share the state their call sites allocated */
+template<class Compiled> class expression_cache {
+	typedef std::unordered_map<std::string, Compiled *> compiled_map;
+
+	compiled_map                                   _shared;
+	std::unordered_map<const void *, compiled_map> _owned;
+	void (*_release)(Compiled *);
+
+public:
+	expression_cache(void (*release)(Compiled *)) : _release(release)
+	{
+	}
+	expression_cache(const expression_cache &) = delete;
+	expression_cache &operator=(const expression_cache &) = delete;
+	~expression_cache()
+	{
+		clear();
+	}
+
+	/* Returns whether the text was compiled before, compiled may still be null
+	 * when that compile failed */
+	bool find(const std::string &expression, const void *owner, Compiled *&compiled) const
+	{
+		auto o = _owned.find(owner);
+		if (o != _owned.end()) {
+			auto it = o->second.find(expression);
+			if (it != o->second.end()) {
+				compiled = it->second;
+				return true;
+			}
+		}
+		auto it = _shared.find(expression);
+		if (it == _shared.end())
+			return false;
+		compiled = it->second;
+		return true;
+	}
+
+	void insert(const std::string &expression, const void *owner, Compiled *compiled, bool stateful)
+	{
+		compiled_map &map = stateful ? _owned[owner] : _shared;
+		auto          it = map.find(expression);
+		if (it != map.end() && it->second != compiled)
+			_release(it->second);
+		map[expression] = compiled;
+	}
+
+	void clear()
+	{
+		for (const auto &it : _shared)
+			_release(it.second);
+		_shared.clear();
+		for (const auto &o : _owned) {
+			for (const auto &it : o.second)
+				_release(it.second);
+		}
+		_owned.clear();
+	}
+};
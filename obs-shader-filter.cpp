@@ -83,28 +83,6 @@ static double dfloor(double d)
 	return floor(d);
 }
 
-struct particlePoints {
-	union {
-		struct {
-			vec3 tl, tr, bl, br;
-		};
-		vec3 ptr[4];
-	};
-};
-
-struct transformAlpha {
-	matrix4 position;
-	matrix4 transform;
-	vec3 pos;
-
-	float decayAlpha;
-	float alpha;
-	float lifeTime;
-	float localLifeTime;
-
-	particlePoints v;
-};
-
 static double fac(double a)
 {/* simplest version of fac */
 	if (a < 0.0)
@@ -145,6 +123,26 @@ static double npr(double n, double r)
 static std::vector<double> screenHeights;
 static std::vector<double> screenWidths;
 static PThreadMutex *screenMutex = nullptr;
+static ParticleThreadPool *particlePool = nullptr;
+static ParticleSimulation *particleSimulation = nullptr;
+static gs_vertbuffer_t *particleQuadBuffer = nullptr;
+static gs_indexbuffer_t *particleIndexBuffer = nullptr;
+static size_t particleQuadCapacity = 0;
+static RenderTargetPool *renderTargets = nullptr;
+static SourceRenderCache *sourceRenders = nullptr;
+/* Writes the timing csv files so the video thread never blocks on disk */
+static os_task_queue_t *profileWriter = nullptr;
+/* Pooled targets left unused this long are destroyed */
+#define RENDER_TARGET_EXPIRY_NS 2000000000ULL
+/* Static sources keep rendering this long after their picture last changed */
+#define SOURCE_STATIC_SETTLE_NS 250000000ULL
+/* Particles per row of a system's instance texture, also its smallest capacity */
+#define PARTICLE_INSTANCE_ROW 256
+#define PARTICLE_INSTANCE_TEXELS (PARTICLE_INSTANCE_SIZE / 4)
+/* Emitters a particle texture may declare through _n suffixed annotations */
+#define PARTICLE_MAX_EMITTERS 64
+/* Upper bound for the max_particles annotation, 16384 instance texture rows */
+#define PARTICLE_MAX_CAPACITY (1 << 22)
 
 
 /*float precision 2.71828182845904523536*/
@@ -158,6 +156,34 @@ static double       frame_rate;
 static double       output_channels;
 static std::string  dir[4] = { "left", "right", "top", "bottom" };
 static gs_effect_t *default_effect = nullptr;
+static gs_effect_t *particle_effect = nullptr;
+static gs_effect_t *upsample_effect = nullptr;
+
+/* Handles into the module's and libobs' effects, resolved once when they load */
+static struct {
+	gs_technique_t *draw;
+	gs_technique_t *clear;
+	gs_eparam_t    *image;
+	gs_eparam_t    *instances;
+	gs_eparam_t    *atlasSize;
+	gs_eparam_t    *atlasFps;
+} particle = {};
+
+static struct {
+	gs_technique_t *bilinear;
+	gs_technique_t *edge;
+	gs_technique_t *interpolate;
+	gs_eparam_t    *image;
+	gs_eparam_t    *guide;
+	gs_eparam_t    *lowSize;
+	gs_eparam_t    *previous;
+	gs_eparam_t    *interpolation;
+} upsample = {};
+
+static struct {
+	gs_technique_t *draw;
+	gs_eparam_t    *image;
+} base = {};
 
 #define WRAPVOID(x) reinterpret_cast<void*>(x)
 
@@ -203,10 +229,88 @@ static const std::vector<te_variable> te_funcs({
 	{"tanh", WRAPVOID(static_cast<double(*)(double)>(&tanh)),    TE_FUNCTION1 | TE_FLAG_PURE, nullptr},
 });
 
+/* Stateful functions, a slot rolls over once per frame so repeated calls within a frame agree */
+static inline expression_slot *rollSlot(void *context, double initial)
+{
+	expression_slot *slot = static_cast<expression_slot *>(context);
+	uint64_t         frame = slot->state->frame;
+	if (slot->frame == UINT64_MAX)
+		slot->value = initial;
+	if (slot->frame != frame) {
+		slot->last = slot->value;
+		slot->frame = frame;
+	}
+	return slot;
+}
+
+/* Particles of the spawning system within radius of the particle being spawned */
+static double particle_neighbors(void *context, double radius)
+{
+	particleQuery *query = (particleQuery *)context;
+	if (!query->grid)
+		return 0;
+	return (double)query->grid->count(query->x, query->y, (float)radius);
+}
+
+/* Called once per neighbors() call site as it compiles, the call site shares the query */
+static void *particle_neighbors_bind(void *arena, size_t size)
+{
+	UNUSED_PARAMETER(size);
+	particleQuery *query = (particleQuery *)arena;
+	if (query->useGrid)
+		*query->useGrid = true;
+	return query;
+}
+
+static double state_prev(void *context, double x)
+{
+	expression_slot *slot = rollSlot(context, x);
+	slot->value = x;
+	return slot->last;
+}
+
+static double state_smooth(void *context, double x, double rate)
+{
+	expression_slot *slot = rollSlot(context, x);
+	slot->value = slot->last + (x - slot->last) * hlsl_clamp(rate, 0, 1);
+	return slot->value;
+}
+
+static double state_integrate(void *context, double x)
+{
+	expression_slot *slot = rollSlot(context, 0);
+	slot->value = slot->last + x * slot->state->seconds;
+	return slot->value;
+}
+
+static double state_delay(void *context, double x, double frames)
+{
+	expression_delay_slot *d = static_cast<expression_delay_slot *>(context);
+	uint64_t               frame = d->slot.state->frame;
+	size_t                 i;
+	if (d->slot.frame == UINT64_MAX) {
+		for (i = 0; i < EXPRESSION_DELAY_FRAMES; i++)
+			d->history[i] = x;
+	}
+	if (d->slot.frame != frame) {
+		d->head = (d->head + 1) % EXPRESSION_DELAY_FRAMES;
+		d->slot.frame = frame;
+	}
+	d->history[d->head] = x;
+	size_t n = (size_t)hlsl_clamp(frames, 0, EXPRESSION_DELAY_FRAMES - 1);
+	return d->history[(d->head + EXPRESSION_DELAY_FRAMES - n) % EXPRESSION_DELAY_FRAMES];
+}
+
 /* Additional likely to be used functions for mathmatical expressions */
 static void prepFunctions(std::vector<te_variable> *vars, ShaderSource *filter)
 {
+	ExpressionState *state = filter->getExpressionState();
+	filter->_neighborsBinding = { &particle_neighbors_bind, &filter->_particleQuery, 0 };
 	std::vector<te_variable> filter_funcs({
+		{"delay", WRAPVOID(&state_delay), TE_CLOSURE2 | TE_FLAG_STATEFUL, &state->delayAllocator},
+		{"integrate", WRAPVOID(&state_integrate), TE_CLOSURE1 | TE_FLAG_STATEFUL, &state->slotAllocator},
+		{"prev", WRAPVOID(&state_prev), TE_CLOSURE1 | TE_FLAG_STATEFUL, &state->slotAllocator},
+		{"smooth", WRAPVOID(&state_smooth), TE_CLOSURE2 | TE_FLAG_STATEFUL, &state->slotAllocator},
 		{"key", &filter->_key, TE_VARIABLE, nullptr},
 		{"key_pressed", &filter->_keyUp, TE_VARIABLE, nullptr},
 		{"sample_rate", &sample_rate, TE_VARIABLE, nullptr},
@@ -231,6 +335,7 @@ static void prepFunctions(std::vector<te_variable> *vars, ShaderSource *filter)
 		{"screen_width", WRAPVOID(static_cast<double(*)(double)>(&getScreenWidth)), TE_FUNCTION1, nullptr},
 		{"mouse_screen", &filter->_screenIndex, TE_VARIABLE, nullptr},
 		{"mix", &filter->mixPercent, TE_VARIABLE, nullptr},
+		{"neighbors", WRAPVOID(&particle_neighbors), TE_CLOSURE1 | TE_FLAG_STATEFUL, &filter->_neighborsBinding},
 	});
 
 	vars->reserve(vars->size() + filter_funcs.size() + te_funcs.size());
@@ -637,9 +742,7 @@ public:
 
 	template<class DataType> void setValue(DataType *data, size_t size)
 	{
-		size_t len = size / sizeof(DataType);
-		size_t arraySize = len * sizeof(DataType);
-		gs_effect_set_val(_param, data, arraySize);
+		gs_effect_set_val(_param, data, size - size % sizeof(DataType));
 	}
 
 	template<class DataType> void setValue(std::vector<DataType> data)
@@ -665,6 +768,7 @@ protected:
 	std::vector<std::string> _tooltips;
 	std::vector<std::string> _bindingNames;
 	std::vector<std::string> _expressions;
+	std::string              _vectorExpression;
 
 	size_t _dataCount;
 
@@ -732,6 +836,13 @@ public:
 			push_back(&_expressions, "expr" + strNum, "");
 		}
 
+		/* Vectors and matrices may use one "expr" for every component: "(x, y, z, w)" */
+		if (_dataCount > 1) {
+			EVal *v = _param->getAnnotationValue("expr");
+			if (v)
+				_vectorExpression = v->getString();
+		}
+
 		auto assign = [=](std::string *str, std::string name) {
 			if (str->empty()) {
 				EVal *v = _param->getAnnotationValue(name);
@@ -770,7 +881,7 @@ public:
 		UNUSED_PARAMETER(filter);
 	};
 
-	virtual void onPass(ShaderSource *filter, const char *technique, size_t pass, gs_texture_t *texture)
+	virtual void onPass(ShaderSource *filter, gs_technique_t *technique, size_t pass, gs_texture_t *texture)
 	{
 		UNUSED_PARAMETER(filter);
 		UNUSED_PARAMETER(technique);
@@ -778,12 +889,34 @@ public:
 		UNUSED_PARAMETER(texture);
 	}
 
-	virtual void onTechniqueEnd(ShaderSource *filter, const char *technique, gs_texture_t *texture)
+	virtual void onTechniqueEnd(ShaderSource *filter, gs_technique_t *technique, gs_texture_t *texture)
 	{
 		UNUSED_PARAMETER(filter);
 		UNUSED_PARAMETER(technique);
 		UNUSED_PARAMETER(texture);
 	}
+
+	/* Returns true when this parameter is the output of the pass and its target is bound */
+	virtual bool beginPass(ShaderSource *filter, gs_technique_t *technique, size_t pass, uint32_t cx, uint32_t cy)
+	{
+		UNUSED_PARAMETER(filter);
+		UNUSED_PARAMETER(technique);
+		UNUSED_PARAMETER(pass);
+		UNUSED_PARAMETER(cx);
+		UNUSED_PARAMETER(cy);
+		return false;
+	}
+
+	virtual void endPass(ShaderSource *filter)
+	{
+		UNUSED_PARAMETER(filter);
+	}
+
+	/* The param_phase hooks this data needs dispatched, read once after init */
+	virtual uint32_t phases()
+	{
+		return 0;
+	}
 };
 
 class NumericalData : public ShaderData {
@@ -877,6 +1010,33 @@ protected:
 
 	NumericalType _numType;
 
+	std::vector<double> _vectorResults;
+	size_t              _vectorCount = 0;
+
+	void setComponent(size_t i, double value)
+	{
+		switch (_paramType) {
+		case GS_SHADER_PARAM_BOOL:
+		case GS_SHADER_PARAM_INT:
+		case GS_SHADER_PARAM_INT2:
+		case GS_SHADER_PARAM_INT3:
+		case GS_SHADER_PARAM_INT4:
+			_bindings[i].d = (double)(long long)value;
+			_values[i].s32i = (int32_t)_bindings[i].d;
+			break;
+		case GS_SHADER_PARAM_FLOAT:
+		case GS_SHADER_PARAM_VEC2:
+		case GS_SHADER_PARAM_VEC3:
+		case GS_SHADER_PARAM_VEC4:
+		case GS_SHADER_PARAM_MATRIX4X4:
+			_bindings[i].d = value;
+			_values[i].f = (float)_bindings[i].d;
+			break;
+		default:
+			break;
+		}
+	}
+
 public:
 	NumericalData(ShaderParameter *parent, ShaderSource *filter) : ShaderData(parent, filter)
 	{
@@ -1017,12 +1177,30 @@ public:
 		}
 
 		bool hasExpressions = false;
-		for (i = 0; i < _expressions.size(); i++) {
+		if (!_vectorExpression.empty()) {
+			hasExpressions = true;
+			_filter->compileVectorExpression(_vectorExpression, &_vectorExpression);
+			if (_filter->vectorExpressionCompiled()) {
+				_vectorResults.resize(_dataCount);
+				_vectorCount = _filter->evaluateVectorExpression(_vectorResults.data(), _dataCount);
+				for (i = 0; i < _vectorCount; i++) {
+					setComponent(i, _vectorResults[i]);
+					_skipProperty[i] = true;
+				}
+			} else {
+				for (i = 0; i < _dataCount; i++) {
+					_disableProperty[i] = true;
+					_tooltips[i] = _filter->expressionError();
+				}
+			}
+		}
+
+		for (i = _vectorCount; i < _expressions.size(); i++) {
 			if (_expressions[i].empty())
 				continue;
 
 			hasExpressions = true;
-			_filter->compileExpression(_expressions[i]);
+			_filter->compileExpression(_expressions[i], &_expressions[i]);
 			if (_filter->expressionCompiled()) {
 				_skipProperty[i] = true;
 			} else {
@@ -1170,11 +1348,17 @@ public:
 		size_t i;
 		if (_skipCalculations)
 			return;
-		for (i = 0; i < _dataCount; i++) {
+		if (_vectorCount) {
+			_filter->compileVectorExpression(_vectorExpression, &_vectorExpression);
+			_vectorCount = _filter->evaluateVectorExpression(_vectorResults.data(), _dataCount);
+			for (i = 0; i < _vectorCount; i++)
+				setComponent(i, _vectorResults[i]);
+		}
+		for (i = _vectorCount; i < _dataCount; i++) {
 			if (!_expressions[i].empty()) {
 				switch (_paramType) {
 				case GS_SHADER_PARAM_BOOL:
-					_filter->compileExpression(_expressions[i]);
+					_filter->compileExpression(_expressions[i], &_expressions[i]);
 					_bindings[i].d = (double)filter->evaluateExpression<long long>(0);
 					_values[i].s32i = (int32_t)_bindings[i].d;
 					break;
@@ -1182,7 +1366,7 @@ public:
 				case GS_SHADER_PARAM_INT2:
 				case GS_SHADER_PARAM_INT3:
 				case GS_SHADER_PARAM_INT4:
-					_filter->compileExpression(_expressions[i]);
+					_filter->compileExpression(_expressions[i], &_expressions[i]);
 					_bindings[i].d = (double)filter->evaluateExpression<long long>(0);
 					_values[i].s32i = (int32_t)_bindings[i].d;
 					break;
@@ -1191,7 +1375,7 @@ public:
 				case GS_SHADER_PARAM_VEC3:
 				case GS_SHADER_PARAM_VEC4:
 				case GS_SHADER_PARAM_MATRIX4X4:
-					_filter->compileExpression(_expressions[i]);
+					_filter->compileExpression(_expressions[i], &_expressions[i]);
 					_bindings[i].d = (double)filter->evaluateExpression<double>(0);
 					_values[i].f = (float)_bindings[i].d;
 					break;
@@ -1226,17 +1410,27 @@ public:
 		}
 	}
 
+	uint32_t phases()
+	{
+		/*Only bound values and expressions change on tick, bound values never come from settings*/
+		uint32_t phases = PARAM_RENDER;
+		bool     expressions = !_vectorExpression.empty();
+		for (size_t i = 0; i < _expressions.size() && !expressions; i++)
+			expressions = !_expressions[i].empty();
+		if (_bind || expressions)
+			phases |= PARAM_TICK;
+		if (!_bind)
+			phases |= PARAM_UPDATE;
+		return phases;
+	}
+
+	/* Uploads every frame, gs_technique_end clears the current value and an
+	   idle param would fall back to its shader default on the next draw */
 	void setData()
 	{
 		if (!_param)
 			return;
-		if (_isFloat) {
-			float *data = (float *)_values.data();
-			_param->setValue<float>(data, _values.size() * sizeof(float));
-		} else {
-			int *data = (int *)_values.data();
-			_param->setValue<int>(data, _values.size() * sizeof(int));
-		}
+		_param->setValue<out_shader_data>(_values.data(), _values.size() * sizeof(out_shader_data));
 	}
 
 	template<class DataType> void setData(DataType t)
@@ -1320,65 +1514,427 @@ static void fillAudioSourceList(obs_property_t *p)
 	obs_enum_sources(&fillPropertiesAudioSourceList, (void *)p);
 }
 
-static void indexBuffer(std::vector<uint32_t>& vec, uint32_t particles)
+RenderTargetPool::~RenderTargetPool()
+{
+	for (entry &e : _entries)
+		gs_texrender_destroy(e.texrender);
+}
+
+gs_texrender_t *RenderTargetPool::acquire(uint32_t width, uint32_t height, gs_color_format format)
+{
+	uint64_t frame = obs_get_video_frame_time();
+	entry *found = nullptr;
+	for (size_t i = 0; i < _entries.size(); i++) {
+		entry &e = _entries[i];
+		/* Anything held past its frame is reclaimed */
+		bool free = !e.used || e.frame != frame;
+		if (free && e.frame + RENDER_TARGET_EXPIRY_NS < frame) {
+			gs_texrender_destroy(e.texrender);
+			_entries[i--] = _entries.back();
+			_entries.pop_back();
+			continue;
+		}
+		if (!found && free && e.width == width && e.height == height && e.format == format)
+			found = &e;
+	}
+	if (!found) {
+		gs_texrender_t *texrender = gs_texrender_create(format, GS_ZS_NONE);
+		if (!texrender)
+			return nullptr;
+		_entries.push_back({ texrender, width, height, format, false, frame });
+		found = &_entries.back();
+	}
+	found->used = true;
+	found->frame = frame;
+	gs_texrender_reset(found->texrender);
+	return found->texrender;
+}
+
+void RenderTargetPool::release(gs_texrender_t *texrender)
+{
+	for (entry &e : _entries) {
+		if (e.texrender == texrender) {
+			e.used = false;
+			return;
+		}
+	}
+}
+
+/* Only a source's own picture may be kept, enabled filters may animate it */
+static void findEnabledFilter(obs_source_t *parent, obs_source_t *child, void *param)
 {
-	size_t vertexCount = particles * 6;
-	size_t i = vec.size() / 6;
-	vec.reserve(vertexCount);
-	for (; vec.size() < vertexCount; i++) {
-		vec.push_back(0 + (uint32_t)i * 4);
-		vec.push_back(1 + (uint32_t)i * 4);
-		vec.push_back(2 + (uint32_t)i * 4);
-		vec.push_back(1 + (uint32_t)i * 4);
-		vec.push_back(2 + (uint32_t)i * 4);
-		vec.push_back(3 + (uint32_t)i * 4);
+	UNUSED_PARAMETER(parent);
+	if (obs_source_enabled(child))
+		*(bool *)param = true;
+}
+
+/* Whether the source shows the same picture until its settings, size or media time change */
+static bool sourceIsStatic(obs_source_t *source, enum obs_media_state state)
+{
+	bool filtered = false;
+	obs_source_enum_filters(source, findEnabledFilter, &filtered);
+	if (filtered)
+		return false;
+
+	const char *id = obs_source_get_id(source);
+	if (id && strcmp(id, "image_source") == 0) {
+		obs_data_t *settings = obs_source_get_settings(source);
+		std::string file = obs_data_get_string(settings, "file");
+		obs_data_release(settings);
+		/* GIFs may animate */
+		std::string ext = file.size() > 4 ? file.substr(file.size() - 4) : "";
+		std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+		return ext != ".gif";
 	}
+	return state == OBS_MEDIA_STATE_PAUSED || state == OBS_MEDIA_STATE_STOPPED ||
+			state == OBS_MEDIA_STATE_ENDED;
+}
+
+void SourceRenderCache::sourceUpdated(void *data, calldata_t *cd)
+{
+	UNUSED_PARAMETER(cd);
+	entry *e = static_cast<entry *>(data);
+	e->updates.fetch_add(1);
 }
 
-static inline void renderSprite(ShaderSource *filter, gs_effect_t *effect, gs_texture_t *texture, const char *techName, uint32_t &cx, uint32_t &cy)
+void SourceRenderCache::release(entry *e)
+{
+	obs_source_t *source = obs_weak_source_get_source(e->source);
+	if (source) {
+		signal_handler_disconnect(obs_source_get_signal_handler(source), "update", sourceUpdated, e);
+		obs_source_release(source);
+	}
+	gs_texrender_destroy(e->texrender);
+	obs_weak_source_release(e->source);
+}
+
+SourceRenderCache::~SourceRenderCache()
+{
+	for (std::unique_ptr<entry> &e : _entries)
+		release(e.get());
+}
+
+gs_texture_t *SourceRenderCache::render(obs_source_t *source, uint32_t cx, uint32_t cy)
+{
+	uint32_t width = source ? obs_source_get_width(source) : 0;
+	uint32_t height = source ? obs_source_get_height(source) : 0;
+	if (!width || !height)
+		return nullptr;
+
+	uint64_t frame = obs_get_video_frame_time();
+	entry *found = nullptr;
+	for (size_t i = 0; i < _entries.size(); i++) {
+		entry *e = _entries[i].get();
+		if (e->frame + RENDER_TARGET_EXPIRY_NS < frame) {
+			release(e);
+			_entries[i--] = std::move(_entries.back());
+			_entries.pop_back();
+			continue;
+		}
+		if (!found && e->cx == cx && e->cy == cy && obs_weak_source_references_source(e->source, source))
+			found = e;
+	}
+	if (!found) {
+		found = new entry();
+		found->source = obs_source_get_weak_source(source);
+		found->cx = cx;
+		found->cy = cy;
+		found->texrender = gs_texrender_create(GS_RGBA, GS_ZS_NONE);
+		_entries.emplace_back(found);
+		signal_handler_connect(obs_source_get_signal_handler(source), "update", sourceUpdated, found);
+	}
+
+	bool sameSize = found->frame != 0 && found->width == width && found->height == height;
+	if (found->frame == frame && sameSize)
+		return gs_texrender_get_texture(found->texrender);
+
+	/* Static sources render until their picture held for SOURCE_STATIC_SETTLE_NS,
+	   async frames may still land a few frames after the media state changed */
+	enum obs_media_state state = obs_source_media_get_state(source);
+	int64_t              mediaTime = obs_source_media_get_time(source);
+	uint64_t             updates = found->updates.load();
+	bool unchanged = sameSize && found->mediaState == state && found->mediaTime == mediaTime &&
+			found->renderedUpdates == updates;
+	if (!unchanged || !sourceIsStatic(source, state))
+		found->staticSince = 0;
+	else if (!found->staticSince)
+		found->staticSince = frame;
+	else if (found->staticSince + SOURCE_STATIC_SETTLE_NS <= frame) {
+		found->frame = frame;
+		return gs_texrender_get_texture(found->texrender);
+	}
+
+	found->frame = frame;
+	found->width = width;
+	found->height = height;
+	found->mediaState = state;
+	found->mediaTime = mediaTime;
+	found->renderedUpdates = updates;
+
+	float scale_x = cx / (float)width;
+	float scale_y = cy / (float)height;
+
+	gs_texrender_reset(found->texrender);
+	if (gs_texrender_begin(found->texrender, width, height)) {
+		struct vec4 clearColor;
+		vec4_zero(&clearColor);
+
+		gs_clear(GS_CLEAR_COLOR, &clearColor, 1, 0);
+		gs_matrix_scale3f(scale_x, scale_y, 1.0f);
+		obs_source_video_render(source);
+
+		gs_texrender_end(found->texrender);
+	}
+	return gs_texrender_get_texture(found->texrender);
+}
+
+/* Unit quads shared by every particle system, regrown geometrically when a
+ * system needs more. Each vertex carries its corner's uv and the texel of its
+ * particle in the instance texture, the vertex shader expands the quad from
+ * there. Expects the graphics context to be entered. */
+static void reserveParticleQuads(size_t particles)
+{
+	if (particles <= particleQuadCapacity && particleQuadBuffer && particleIndexBuffer)
+		return;
+	size_t capacity = std::max(particles, particleQuadCapacity * 2);
+
+	uint32_t *indices = (uint32_t *)bmalloc(sizeof(uint32_t) * capacity * 6);
+	gs_vb_data *vb = gs_vbdata_create();
+	vb->num = capacity * 4;
+	vb->points = (vec3 *)bmalloc(sizeof(vec3) * vb->num);
+	vb->num_tex = 1;
+	vb->tvarray = (gs_tvertarray *)bzalloc(sizeof(gs_tvertarray));
+	vb->tvarray->width = 4;
+	vb->tvarray->array = bmalloc(sizeof(vec4) * vb->num);
+	vec4 *ar = (vec4 *)vb->tvarray->array;
+
+	for (size_t i = 0; i < capacity; i++) {
+		uint32_t *quad = &indices[i * 6];
+		uint32_t vertex = (uint32_t)i * 4;
+		quad[0] = vertex;
+		quad[1] = vertex + 1;
+		quad[2] = vertex + 2;
+		quad[3] = vertex + 1;
+		quad[4] = vertex + 2;
+		quad[5] = vertex + 3;
+
+		float x = (float)((i % PARTICLE_INSTANCE_ROW) * PARTICLE_INSTANCE_TEXELS);
+		float y = (float)(i / PARTICLE_INSTANCE_ROW);
+		for (uint32_t j = 0; j < 4; j++) {
+			float u = (float)(j & 1);
+			float v = (float)(j >> 1);
+			vec3_set(&vb->points[vertex + j], u - 0.5f, v - 0.5f, 0);
+			vec4_set(&ar[vertex + j], u, v, x, y);
+		}
+	}
+
+	if (particleIndexBuffer)
+		gs_indexbuffer_destroy(particleIndexBuffer);
+	if (particleQuadBuffer)
+		gs_vertexbuffer_destroy(particleQuadBuffer);
+	/* The buffers take ownership of their data */
+	particleIndexBuffer = gs_indexbuffer_create(GS_UNSIGNED_LONG, indices, capacity * 6, 0);
+	particleQuadBuffer = gs_vertexbuffer_create(vb, 0);
+	particleQuadCapacity = particleIndexBuffer && particleQuadBuffer ? capacity : 0;
+}
+
+static inline void renderSprite(ShaderSource *filter, gs_technique_t *tech, gs_texture_t *texture, uint32_t &cx, uint32_t &cy)
 {
 	size_t i, j;
-	gs_technique_t *tech = gs_effect_get_technique(effect, techName);
 	size_t passes = gs_technique_begin(tech);
+	bool   timed = filter->profiler() != nullptr;
 	for (i = 0; i < passes; i++) {
+		/*Passes written to a target texture render there, the rest to the output*/
+		ShaderParameter *output = nullptr;
+		for (j = 0; j < filter->passList.size() && !output; j++) {
+			if (filter->passList[j]->beginPass(filter, tech, i, cx, cy))
+				output = filter->passList[j];
+		}
+		if (timed)
+			filter->beginPassTimer(i);
 		gs_technique_begin_pass(tech, i);
 		gs_draw_sprite(texture, 0, cx, cy);
 		gs_technique_end_pass(tech);
+		if (timed)
+			filter->endPassTimer(i);
+		if (output)
+			output->endPass(filter);
 		/*Handle Buffers*/
-		for (j = 0; j < filter->paramList.size(); j++)
-			filter->paramList[j]->onPass(filter, techName, i, texture);
+		for (j = 0; j < filter->passList.size(); j++)
+			filter->passList[j]->onPass(filter, tech, i, texture);
+	}
+	gs_technique_end(tech);
+	for (j = 0; j < filter->passList.size(); j++)
+		filter->passList[j]->onTechniqueEnd(filter, tech, texture);
+}
+
+/* The scale the effect actually renders at, full size unless it can be upsampled */
+static inline float renderScaleOf(ShaderSource *filter)
+{
+	return upsample_effect ? filter->renderScale : 1.0f;
+}
+
+/* Renders the effect at filter->renderScale of cx, cy into a pooled target and
+ * upsamples it to cx, cy, the input texture guides the edge aware upsampler.
+ * The projection still spans cx, cy so ViewProj maps the sprite onto the smaller target. */
+static inline void renderScaledSprite(ShaderSource *filter, gs_technique_t *tech, gs_texture_t *texture,
+		uint32_t &cx, uint32_t &cy)
+{
+	if (renderScaleOf(filter) >= 1.0f) {
+		renderSprite(filter, tech, texture, cx, cy);
+		return;
+	}
+	uint32_t        lowWidth = std::max((uint32_t)ceilf(cx * filter->renderScale), 1u);
+	uint32_t        lowHeight = std::max((uint32_t)ceilf(cy * filter->renderScale), 1u);
+	gs_texrender_t *low = renderTargets->acquire(lowWidth, lowHeight);
+
+	gs_blend_state_push();
+	gs_blend_function(GS_BLEND_ONE, GS_BLEND_ZERO);
+	bool rendered = gs_texrender_begin(low, lowWidth, lowHeight);
+	if (rendered) {
+		struct vec4 clearColor;
+
+		vec4_zero(&clearColor);
+		gs_clear(GS_CLEAR_COLOR, &clearColor, 0.0f, 0);
+		gs_ortho(0.0f, (float)cx, 0.0f, (float)cy, -100.0f, 100.0f);
+		renderSprite(filter, tech, texture, cx, cy);
+		gs_texrender_end(low);
+	}
+	gs_blend_state_pop();
+
+	gs_texture_t *lowTexture = rendered ? gs_texrender_get_texture(low) : nullptr;
+	if (lowTexture) {
+		struct vec2 lowSize;
+		vec2_set(&lowSize, (float)lowWidth, (float)lowHeight);
+		gs_technique_t *upsampleTech = texture && filter->upsampleEdge ? upsample.edge : upsample.bilinear;
+		gs_effect_set_texture(upsample.image, lowTexture);
+		gs_effect_set_texture(upsample.guide, texture);
+		gs_effect_set_vec2(upsample.lowSize, &lowSize);
+		size_t passes = gs_technique_begin(upsampleTech);
+		for (size_t i = 0; i < passes; i++) {
+			gs_technique_begin_pass(upsampleTech, i);
+			gs_draw_sprite(lowTexture, 0, cx, cy);
+			gs_technique_end_pass(upsampleTech);
+		}
+		gs_technique_end(upsampleTech);
+	}
+	renderTargets->release(low);
+}
+
+/* Draws the cached output, blended from the previous one when interpolating */
+static void drawOutputCache(ShaderSource *filter, uint32_t cx, uint32_t cy)
+{
+	gs_texture_t *front = gs_texrender_get_texture(filter->_outputCache[filter->_outputFront]);
+	gs_texture_t *back = filter->_outputCount > 1 ?
+			gs_texrender_get_texture(filter->_outputCache[filter->_outputFront ^ 1]) : nullptr;
+	if (!front || !upsample_effect)
+		return;
+	gs_technique_t *tech = upsample.bilinear;
+	if (filter->updateInterpolate && back) {
+		tech = upsample.interpolate;
+		gs_effect_set_texture(upsample.previous, back);
+		gs_effect_set_float(upsample.interpolation,
+				(float)hlsl_clamp(filter->_outputAge * filter->updateRate, 0.0, 1.0));
+	}
+	gs_effect_set_texture(upsample.image, front);
+	size_t passes = gs_technique_begin(tech);
+	for (size_t i = 0; i < passes; i++) {
+		gs_technique_begin_pass(tech, i);
+		gs_draw_sprite(front, 0, cx, cy);
+		gs_technique_end_pass(tech);
 	}
 	gs_technique_end(tech);
-	for (j = 0; j < filter->paramList.size(); j++)
-		filter->paramList[j]->onTechniqueEnd(filter, techName, texture);
 }
 
+/* Returns true when the effect is not due and its cached output was drawn instead */
+static bool renderOutputCache(ShaderSource *filter, uint32_t cx, uint32_t cy)
+{
+	if (filter->updateRate <= 0.0f || filter->_outputDirty || !filter->_outputCount)
+		return false;
+	gs_texture_t *front = gs_texrender_get_texture(filter->_outputCache[filter->_outputFront]);
+	if (!front || gs_texture_get_width(front) != cx || gs_texture_get_height(front) != cy)
+		return false;
+	if (filter->_outputAge * filter->updateRate >= 1.0f)
+		return false;
+	drawOutputCache(filter, cx, cy);
+	return true;
+}
+
+/* Renders the effect, through the output cache when the update rate is limited */
+static inline void renderCachedSprite(ShaderSource *filter, gs_technique_t *tech, gs_texture_t *texture,
+		uint32_t &cx, uint32_t &cy)
+{
+	if (filter->updateRate <= 0.0f || !upsample_effect) {
+		renderScaledSprite(filter, tech, texture, cx, cy);
+		return;
+	}
+	size_t back = filter->_outputFront ^ 1;
+	if (!filter->_outputCache[back])
+		filter->_outputCache[back] = gs_texrender_create(GS_RGBA, GS_ZS_NONE);
+	gs_texrender_reset(filter->_outputCache[back]);
+
+	gs_blend_state_push();
+	gs_blend_function(GS_BLEND_ONE, GS_BLEND_ZERO);
+	if (gs_texrender_begin(filter->_outputCache[back], cx, cy)) {
+		struct vec4 clearColor;
+
+		vec4_zero(&clearColor);
+		gs_clear(GS_CLEAR_COLOR, &clearColor, 0.0f, 0);
+		gs_ortho(0.0f, (float)cx, 0.0f, (float)cy, -100.0f, 100.0f);
+		renderScaledSprite(filter, tech, texture, cx, cy);
+		gs_texrender_end(filter->_outputCache[back]);
+
+		/*Outputs from before a resize or settings change are not interpolated from*/
+		filter->_outputCount = filter->_outputDirty ? 1 : std::min(filter->_outputCount + 1, (size_t)2);
+		filter->_outputFront = back;
+		filter->_outputDirty = false;
+		/*Keep the cadence, unless the effect fell more than an update behind*/
+		float interval = 1.0f / filter->updateRate;
+		filter->_outputAge = filter->_outputAge >= 2.0f * interval ? 0.0f :
+				std::max(filter->_outputAge - interval, 0.0f);
+	}
+	gs_blend_state_pop();
+
+	drawOutputCache(filter, cx, cy);
+}
+
+/* Expressions and spawn state of one particle emitter */
+struct particleEmitter {
+	std::string emitterXExpr = "";
+	std::string emitterYExpr = "";
+	std::string emitterZExpr = "";
+	std::string emitterXRotateExpr = "";
+	std::string emitterYRotateExpr = "";
+	std::string emitterZRotateExpr = "";
+	std::string rotateXExpr = "";
+	std::string rotateYExpr = "";
+	std::string rotateZExpr = "";
+	std::string translateXExpr = "";
+	std::string translateYExpr = "";
+	std::string translateZExpr = "";
+	std::string localLifeTimeExpr = "";
+	std::string alphaExpr = "";
+	std::string alphaDecayExpr = "";
+	std::string frameExpr = "";
+	double spawnRate = 0;
+	double spawnCount = 0;
+};
+
 class TextureData : public ShaderData {
 private:
-	void renderSource(uint32_t cx, uint32_t cy)
+	gs_texture_t *renderSource(uint32_t cx, uint32_t cy)
 	{
 		uint32_t mediaWidth = obs_source_get_width(_mediaSource);
 		uint32_t mediaHeight = obs_source_get_height(_mediaSource);
 
 		if (!mediaWidth || !mediaHeight)
-			return;
+			return nullptr;
 
 		_sourceWidth = mediaWidth;
 		_sourceHeight = mediaHeight;
 
-		float scale_x = cx / (float)mediaWidth;
-		float scale_y = cy / (float)mediaHeight;
-
-		if (gs_texrender_begin(_texrender, mediaWidth, mediaHeight)) {
-			struct vec4 clearColor;
-			vec4_zero(&clearColor);
-
-			gs_clear(GS_CLEAR_COLOR, &clearColor, 1, 0);
-			gs_matrix_scale3f(scale_x, scale_y, 1.0f);
-			obs_source_video_render(_mediaSource);
-
-			gs_texrender_end(_texrender);
-		}
+		/*Shared with every other texture showing this source*/
+		return sourceRenders->render(_mediaSource, cx, cy);
 	}
 
 	uint32_t processAudio(size_t samples)
@@ -1396,6 +1952,7 @@ private:
 
 	void renderAudioSource(uint64_t samples)
 	{
+		ProfileScope profile(_filter->profiler(), PROFILE_AUDIO);
 		if (!_data)
 			_data = (uint8_t *)bzalloc(_maxAudioSize * _channels * sizeof(float));
 		size_t pxWidth = samples;
@@ -1423,6 +1980,7 @@ private:
 
 	void updateAudioSource()
 	{
+		ProfileScope  profile(_filter->profiler(), PROFILE_AUDIO);
 		obs_source_t *oldSideChain = _mediaSource;
 		if (_targetName == _sourceName)
 			return;
@@ -1465,7 +2023,6 @@ private:
 	PThreadMutex *_audioMutex = nullptr;
 
 protected:
-	gs_texrender_t    *_texrender = nullptr;
 	gs_texture_t      *_tex = nullptr;
 	gs_image_file_t   *_image = nullptr;
 	std::vector<float> _audio[MAX_AV_PLANES];
@@ -1484,7 +2041,7 @@ protected:
 	uint8_t            _range_0;
 	uint8_t            _range_1;
 	enum TextureType {
-		ignored, unspecified, source, audio, image, media, buffer
+		ignored, unspecified, source, audio, image, media, buffer, target
 	};
 	fft_windowing_type _window;
 	TextureType        _texType;
@@ -1495,42 +2052,46 @@ protected:
 	std::string _mediaSourceLengthBinding;
 	std::string _mediaSourceFramesBinding;
 	std::string _tech;
+	/* _tech resolved in the filter's effect when the parameter loads */
+	gs_technique_t *_technique = nullptr;
 	size_t      _pass;
+
+	/* Pass targets ping-pong between two texrenders, a pass writing the target
+	   reads what the previous write left in the front one */
+	std::vector<size_t> _targetPasses;
+	float               _targetScale = 1;
+	gs_color_format     _targetFormat = GS_RGBA;
+	gs_texrender_t     *_targets[2] = { nullptr, nullptr };
+	int                 _targetFront = 0;
 	double      _sourceWidth;
 	double      _sourceHeight;
 	double      _mediaSourceLength;
 	double      _mediaSourceFrames;
 
-	std::vector<uint32_t> _indexBufferData;
-	gs_vb_data *_vertexBufferData = nullptr;
-	gs_indexbuffer_t *_indexBuffer = nullptr;
-	gs_vertbuffer_t *_vertexBuffer = nullptr;
+	gs_texture_t *_instanceTexture = nullptr;
+	std::vector<float> _instanceData;
+	size_t _instanceCapacity = 0;
+	size_t _drawCount = 0;
 
 	double _particleLifeTime = 10;
-	double _spawnRate = 1;
-	double _spawnCount = 0;
-	size_t _maxParticleCount = 0;
-	bool _despawnOld = true;
-	bool _despawnOutOfView = true;
-
-	std::string _emitterXExpr = "";
-	std::string _emitterYExpr = "";
-	std::string _emitterZExpr = "";
-	std::string _emitterXRotateExpr = "";
-	std::string _emitterYRotateExpr = "";
-	std::string _emitterZRotateExpr = "";
-	std::string _rotateXExpr = "";
-	std::string _rotateYExpr = "";
-	std::string _rotateZExpr = "";
-	std::string _translateXExpr = "";
-	std::string _translateYExpr = "";
-	std::string _translateZExpr = "";
-	std::string _localLifeTimeExpr = "";
-	std::string _alphaExpr = "";
-	std::string _alphaDecayExpr = "";
+	size_t _maxParticleCount = 10000;
+	bool _killOldest = false;
+	std::vector<particleEmitter> _emitters;
+	int _atlasColumns = 1;
+	int _atlasRows = 1;
+	float _atlasFps = 0;
 
 	gs_texrender_t * _particlerender = nullptr;
-	std::vector<transformAlpha> _particles;
+	particleSystem _system;
+	std::vector<uint32_t> _drawOrder;
+	std::vector<particle_sort_key> _sortScratch;
+	bool _sortParticles = true;
+	/*Particles render at a fraction of the output size, only the area they cover is redrawn*/
+	float _particleScale = 1;
+	float _bounds[4] = { 0, 0, 0, 0 };
+	uint32_t _particleWidth = 0;
+	uint32_t _particleHeight = 0;
+	int _drawnRect[4] = { 0, 0, 0, 0 };
 public:
 	TextureData(ShaderParameter *parent, ShaderSource *filter)
 		: ShaderData(parent, filter), _maxAudioSize(AUDIO_OUTPUT_FRAMES * 2)
@@ -1542,6 +2103,8 @@ public:
 
 	~TextureData()
 	{
+		if (_isParticle)
+			particleSimulation->remove(&_system);
 		if (_texType == audio)
 			obs_source_remove_audio_capture_callback(_mediaSource, sidechain_capture, this);
 		if (_mediaSource)
@@ -1549,20 +2112,19 @@ public:
 		_mediaSource = nullptr;
 
 		obs_enter_graphics();
-		gs_texrender_destroy(_texrender);
 		gs_texrender_destroy(_particlerender);
+		gs_texrender_destroy(_targets[0]);
+		gs_texrender_destroy(_targets[1]);
 		gs_image_file_free(_image);
 		if (_tex)
 			gs_texture_destroy(_tex);
-		if (_vertexBuffer)
-			gs_vertexbuffer_destroy(_vertexBuffer);
-		if (_indexBuffer)
-			gs_indexbuffer_destroy(_indexBuffer);
+		if (_instanceTexture)
+			gs_texture_destroy(_instanceTexture);
 		obs_leave_graphics();
-		if (_vertexBufferData)
-			gs_vbdata_destroy(_vertexBufferData);
+		_instanceTexture = nullptr;
+		_instanceCapacity = 0;
+		_drawCount = 0;
 
-		_texrender = nullptr;
 		_tex = nullptr;
 		if (_image)
 			bfree(_image);
@@ -1631,24 +2193,36 @@ public:
 
 	void init(gs_shader_param_type paramType)
 	{
-		if (!_texrender)
-			_texrender = gs_texrender_create(GS_RGBA, GS_ZS_NONE);
-
 		_paramType = paramType;
 		_names.push_back(_parent->getName());
 		_descs.push_back(_parent->getDescription());
 
 		EVal                                     *texType = _param->getAnnotationValue("type");
 		std::unordered_map<std::string, uint32_t> types = { {"source", source}, {"audio", audio},
-				{"image", image}, {"media", media}, {"buffer", buffer} };
+				{"image", image}, {"media", media}, {"buffer", buffer}, {"target", target} };
 
 		if (texType && types.find(texType->getString()) != types.end())
 			_texType = (TextureType)types.at(texType->getString());
 		else
 			_texType = image;
 
-		if (_names[0] == "image" || _names[0] == "image_0")
+		if (_names[0] == "image" || _names[0] == "image_0") {
 			_texType = ignored;
+			/*Only the shader knows it samples image at the vertex uv alone, so this is opt in*/
+			if (!_param->getAnnotationValue<bool>("direct_render", false))
+				_filter->directRender = false;
+			/*The shader's suggested render scale, the property overrides it*/
+			obs_data_set_default_double(_filter->getSettings(), "render_scale",
+					hlsl_clamp(_param->getAnnotationValue<float>("render_scale", 1), 0.05, 1.0));
+			obs_data_set_default_double(_filter->getSettings(), "update_rate",
+					hlsl_clamp(_param->getAnnotationValue<float>("update_rate", 0), 0.0, 60.0));
+			obs_data_set_default_bool(_filter->getSettings(), "update_interpolate",
+					_param->getAnnotationValue<bool>("interpolate", false));
+			EVal *upsample = _param->getAnnotationValue("upsample");
+			if (upsample)
+				obs_data_set_default_string(_filter->getSettings(), "render_upsample",
+						upsample->getString() == "edge" ? "Edge" : "Bilinear");
+		}
 		else if (_filter->getType() == OBS_SOURCE_TYPE_TRANSITION && _names[0] == "image_1")
 			_texType = ignored;
 
@@ -1657,6 +2231,7 @@ public:
 
 		EVal *techAnnotation = _param->getAnnotationValue("technique");
 		EVal *window = nullptr;
+		EVal *format = nullptr;
 		switch (_texType) {
 		case audio:
 			_channels = _param->getAnnotationValue<int>("channels", 0);
@@ -1678,6 +2253,31 @@ public:
 			else
 				_tech = "";
 			_pass = _param->getAnnotationValue<int>("pass", -1);
+			_technique = _tech.empty() ? nullptr : gs_effect_get_technique(_filter->effect, _tech.c_str());
+			/* Buffers copy the rendered target */
+			_filter->directRender = false;
+			break;
+		case target:
+			if (techAnnotation)
+				_tech = techAnnotation->getString();
+			else
+				_tech = "Draw";
+			_technique = gs_effect_get_technique(_filter->effect, _tech.c_str());
+			_targetPasses.clear();
+			_targetPasses.push_back(_param->getAnnotationValue<int>("pass", 0));
+			for (size_t i = 1; _param->getAnnotationValue("pass_" + std::to_string(i)); i++)
+				_targetPasses.push_back(_param->getAnnotationValue<int>("pass_" + std::to_string(i), 0));
+			_targetScale = hlsl_clamp(_param->getAnnotationValue<float>("scale", 1), 0.05, 2.0);
+			format = _param->getAnnotationValue("format");
+			if (format) {
+				std::unordered_map<std::string, gs_color_format> formats = { {"rgba", GS_RGBA},
+						{"rgba16f", GS_RGBA16F}, {"rgba32f", GS_RGBA32F}, {"r16f", GS_R16F},
+						{"r32f", GS_R32F} };
+				auto found = formats.find(format->getString());
+				_targetFormat = found != formats.end() ? found->second : GS_RGBA;
+			}
+			/* Targets are drawn by the technique's passes, not by the source */
+			_filter->directRender = false;
 			break;
 		case media:
 			_mediaSourceFramesBinding = _bindingNames[0] + "_frames";
@@ -1701,34 +2301,66 @@ public:
 		}
 
 		_isParticle = _param->getAnnotationValue<bool>("is_particle", false);
-		_spawnRate = hlsl_clamp(_param->getAnnotationValue<float>("spawn_rate", 0), 0, 1000);
 
 		if (_isParticle) {
-			const std::vector<std::pair<std::string *, std::string>> expressions = {
-				{&_emitterXExpr, "emitter_x"},
-				{&_emitterYExpr, "emitter_y"},
-				{&_emitterZExpr, "emitter_z"},
-				{&_emitterXRotateExpr, "emitter_rotate_x"},
-				{&_emitterYRotateExpr, "emitter_rotate_y"},
-				{&_emitterZRotateExpr, "emitter_rotate_z"},
-				{&_rotateXExpr, "rotate_x"},
-				{&_rotateYExpr, "rotate_y"},
-				{&_rotateZExpr, "rotate_z"},
-				{&_translateXExpr, "translate_x"},
-				{&_translateYExpr, "translate_y"},
-				{&_translateZExpr, "translate_z"},
-				{&_alphaExpr, "alpha"},
-				{&_alphaDecayExpr, "alpha_decay"},
-				{&_localLifeTimeExpr,"particle_sec"}
+			const std::vector<std::pair<std::string particleEmitter::*, std::string>> expressions = {
+				{&particleEmitter::emitterXExpr, "emitter_x"},
+				{&particleEmitter::emitterYExpr, "emitter_y"},
+				{&particleEmitter::emitterZExpr, "emitter_z"},
+				{&particleEmitter::emitterXRotateExpr, "emitter_rotate_x"},
+				{&particleEmitter::emitterYRotateExpr, "emitter_rotate_y"},
+				{&particleEmitter::emitterZRotateExpr, "emitter_rotate_z"},
+				{&particleEmitter::rotateXExpr, "rotate_x"},
+				{&particleEmitter::rotateYExpr, "rotate_y"},
+				{&particleEmitter::rotateZExpr, "rotate_z"},
+				{&particleEmitter::translateXExpr, "translate_x"},
+				{&particleEmitter::translateYExpr, "translate_y"},
+				{&particleEmitter::translateZExpr, "translate_z"},
+				{&particleEmitter::alphaExpr, "alpha"},
+				{&particleEmitter::alphaDecayExpr, "alpha_decay"},
+				{&particleEmitter::localLifeTimeExpr,"particle_sec"},
+				{&particleEmitter::frameExpr, "frame"}
 			};
-			EVal *l = nullptr;
-			for (size_t i = 0; i < expressions.size(); i++) {
-				l = _param->getAnnotationValue(expressions[i].second);
-				if (l)
-					*expressions[i].first = *l;
+			/* Emitter n > 0 is declared by any of its annotations suffixed _n,
+			 * whatever it leaves out is taken from the first emitter */
+			_emitters.clear();
+			for (size_t n = 0; n < PARTICLE_MAX_EMITTERS; n++) {
+				std::string strNum = n ? "_" + std::to_string(n) : "";
+				particleEmitter emitter = n ? _emitters[0] : particleEmitter();
+				bool declared = n == 0;
+				EVal *l = nullptr;
+				for (size_t i = 0; i < expressions.size(); i++) {
+					l = _param->getAnnotationValue(expressions[i].second + strNum);
+					if (l) {
+						emitter.*expressions[i].first = *l;
+						declared = true;
+					}
+				}
+				if (_param->getAnnotationValue("spawn_rate" + strNum))
+					declared = true;
+				if (!declared)
+					break;
+				emitter.spawnRate = hlsl_clamp(_param->getAnnotationValue<float>("spawn_rate" + strNum,
+						n ? (float)_emitters[0].spawnRate : 0), 0, 1000);
+				emitter.spawnCount = 0;
+				_emitters.push_back(emitter);
 			}
-			_despawnOutOfView = _param->getAnnotationValue<bool>("remove_not_visible", false);
-			_despawnOld = _param->getAnnotationValue<bool>("remove_old", true);
+			_system.despawnOutOfView = _param->getAnnotationValue<bool>("remove_not_visible", false);
+			_system.despawnOld = _param->getAnnotationValue<bool>("remove_old", true);
+			_sortParticles = _param->getAnnotationValue<bool>("sort_particles", true);
+			_maxParticleCount = (size_t)hlsl_clamp(_param->getAnnotationValue<int>("max_particles", 10000), 1,
+					PARTICLE_MAX_CAPACITY);
+			EVal *overflow = _param->getAnnotationValue("overflow");
+			_killOldest = overflow && overflow->getString() == "kill_oldest";
+			_atlasColumns = hlsl_clamp(_param->getAnnotationValue<int>("atlas_columns", 1), 1, 256);
+			_atlasRows = hlsl_clamp(_param->getAnnotationValue<int>("atlas_rows", 1), 1, 256);
+			_atlasFps = _param->getAnnotationValue<float>("atlas_fps", 0);
+			_particleScale = hlsl_clamp(_param->getAnnotationValue<float>("particle_scale", 1), 0.05, 1.0);
+			_system.setCapacity(_maxParticleCount);
+			_system.grid.cellSize = hlsl_clamp(_param->getAnnotationValue<float>("grid_cell", 0.1f), 0.01, 2.0);
+			/* Raised when an emitter expression compiles a neighbors() call */
+			_system.useGrid = false;
+			particleSimulation->add(&_system);
 		}
 	}
 
@@ -1796,8 +2428,6 @@ public:
 
 		switch (_texType) {
 		case source:
-			if (!_texrender)
-				_texrender = gs_texrender_create(GS_RGBA, GS_ZS_NONE);
 			if (_mediaSource)
 				obs_source_remove_active_child(_filter->context, _mediaSource);
 			obs_source_release(_mediaSource);
@@ -1806,9 +2436,6 @@ public:
 				obs_source_add_active_child(_filter->context, _mediaSource);
 			break;
 		case media:
-			if (!_texrender)
-				_texrender = gs_texrender_create(GS_RGBA, GS_ZS_NONE);
-
 			path = obs_data_get_string(settings, _names[0].c_str());
 			media_settings = obs_data_create();
 			obs_data_set_string(media_settings, "local_file", path);
@@ -1858,24 +2485,27 @@ public:
 	void calculateExpression(T& val, std::string& expr, T fallback = 0)
 	{
 		if (!expr.empty()) {
-			_filter->compileExpression(expr);
+			_filter->compileExpression(expr, &expr);
 			val = _filter->evaluateExpression<T>(fallback);
 		}
 	}
-	void inline generateParticle(float &elapsedTime, float &seconds)
+	void inline generateParticle(const particleEmitter &emitter, float &elapsedTime, float &seconds)
 	{
 		UNUSED_PARAMETER(elapsedTime);
-		transformAlpha p = { 0 };
-		p.alpha = 255.0;
-		matrix4_identity(&p.position);
-		matrix4_identity(&p.transform);
+		float alpha = 255.0;
+		float decayAlpha = 0;
+		float localLifeTime = 0;
 		float rate = 1.0f / frame_rate;
 		double x = 0;
 		double y = 0;
 		double z = 0;
+		double ax = 0;
+		double ay = 0;
+		double az = 0;
+		_filter->_particleQuery.useGrid = &_system.useGrid;
 		auto assign = [=](const std::string &expr, double *v, const double fallback) {
 			if (!expr.empty()) {
-				_filter->compileExpression(expr);
+				_filter->compileExpression(expr, &expr);
 				*v = _filter->evaluateExpression<double>(fallback);
 			} else {
 				*v = fallback;
@@ -1883,37 +2513,47 @@ public:
 		};
 		auto assign_flt = [=](const std::string &expr, float *v, const double fallback) {
 			if (!expr.empty()) {
-				_filter->compileExpression(expr);
+				_filter->compileExpression(expr, &expr);
 				*v = _filter->evaluateExpression<double>(fallback);
 			} else {
 				*v = fallback;
 			}
 		};
-		assign(_emitterXExpr, &x, 0);
-		assign(_emitterYExpr, &y, 0);
-		assign(_emitterZExpr, &z, 0);
-		matrix4_translate3f(&p.position, &p.position, x, y, z);
-
-		assign(_emitterXRotateExpr, &x, 0);
-		assign(_emitterYRotateExpr, &y, 0);
-		assign(_emitterZRotateExpr, &z, 0);
-		matrix4_rotate_aa4f(&p.position, &p.position, x, y, z, rate);
-
-		assign(_rotateXExpr, &x, 0);
-		assign(_rotateYExpr, &y, 0);
-		assign(_rotateZExpr, &z, 0);
-		matrix4_translate3f(&p.transform, &p.transform, x*rate, y*rate, z*rate);
-
-		assign(_translateXExpr, &x, 0);
-		assign(_translateYExpr, &y, 0);
-		assign(_translateZExpr, &z, 0);
-		matrix4_rotate_aa4f(&p.transform, &p.transform, x, y, z, rate);
+		float position[PARTICLE_AFFINE_SIZE];
+		float transform[PARTICLE_AFFINE_SIZE];
+
+		assign(emitter.emitterXExpr, &x, 0);
+		assign(emitter.emitterYExpr, &y, 0);
+		assign(emitter.emitterZExpr, &z, 0);
+		assign(emitter.emitterXRotateExpr, &ax, 0);
+		assign(emitter.emitterYRotateExpr, &ay, 0);
+		assign(emitter.emitterZRotateExpr, &az, 0);
+		particle_affine_compose(position, x, y, z, ax, ay, az, rate);
+		if (_system.useGrid) {
+			_filter->_particleQuery.grid = &_system.grid;
+			_filter->_particleQuery.x = position[9];
+			_filter->_particleQuery.y = position[10];
+		}
 
-		assign_flt(_localLifeTimeExpr, &p.localLifeTime, 0);
-		p.lifeTime = -seconds;
-		assign_flt(_alphaExpr, &p.alpha, 255.0);
-		assign_flt(_alphaDecayExpr, &p.decayAlpha, 0);
-		_particles.push_back(p);
+		assign(emitter.rotateXExpr, &x, 0);
+		assign(emitter.rotateYExpr, &y, 0);
+		assign(emitter.rotateZExpr, &z, 0);
+		assign(emitter.translateXExpr, &ax, 0);
+		assign(emitter.translateYExpr, &ay, 0);
+		assign(emitter.translateZExpr, &az, 0);
+		particle_affine_compose(transform, x * rate, y * rate, z * rate, ax, ay, az, rate);
+
+		assign_flt(emitter.localLifeTimeExpr, &localLifeTime, 0);
+		assign_flt(emitter.alphaExpr, &alpha, 255.0);
+		assign_flt(emitter.alphaDecayExpr, &decayAlpha, 0);
+		float frame = 0;
+		assign_flt(emitter.frameExpr, &frame, 0);
+
+		_filter->_particleQuery.grid = nullptr;
+		_filter->_particleQuery.useGrid = nullptr;
+
+		_system.spawn(position, transform, alpha, decayAlpha, localLifeTime, -seconds, frame,
+				_atlasColumns * _atlasRows);
 	}
 
 	void videoTick(ShaderSource *filter, float elapsedTime, float seconds)
@@ -1922,7 +2562,6 @@ public:
 		UNUSED_PARAMETER(elapsedTime);
 		gs_texture_t *t;
 		obs_enter_graphics();
-		gs_texrender_reset(_texrender);
 		switch (_texType) {
 		case media:
 		case source:
@@ -1951,154 +2590,114 @@ public:
 			break;
 		}
 
-		if (!_isParticle) {
-			obs_leave_graphics();
-			return;
-		}
+		if (_isParticle)
+			gs_texrender_reset(_particlerender);
+		obs_leave_graphics();
 
-		gs_texrender_reset(_particlerender);
+		if (!_isParticle)
+			return;
 
+		ProfileScope profile(filter->profiler(), PROFILE_PARTICLES);
+		/*Simulate outside the graphics context, only the upload needs it.
+		  Every particle system advances in one dispatch, on the first tick of a frame*/
 		const float rate = 1.0f / frame_rate;
-		/*Spawn new particles*/
-		size_t oldSize = _particles.size();
-		_spawnCount += (_spawnRate / frame_rate);
-		size_t spawn = (size_t)floor(_spawnCount);
+		particleSimulation->step(obs_get_video_frame_time(), seconds, rate);
 
-		_particles.reserve(_particles.size() + spawn);
-		for (float i = 1.0f; i <= (float)_spawnCount; i += 1.0f) {
-			generateParticle(elapsedTime, seconds);
+		/*Spawn new particles*/
+		particleStorage &particles = _system.particles;
+		size_t spawn = 0;
+		for (particleEmitter &emitter : _emitters) {
+			emitter.spawnCount += (emitter.spawnRate / frame_rate);
+			spawn += (size_t)floor(emitter.spawnCount);
 		}
-		_spawnCount -= floor(_spawnCount);
-
-		std::for_each(_particles.begin(), _particles.end(), [&seconds, &rate](transformAlpha &p) {
-			p.lifeTime += seconds;
-			p.alpha = hlsl_clamp(p.alpha - (p.decayAlpha * rate), 0, 255);
-		});
 
-		if (_despawnOld) {
-			/*Remove old particles*/
-			_particles.erase(std::remove_if(_particles.begin(), _particles.end(), [](transformAlpha p) {
-				return p.localLifeTime < p.lifeTime;
-			}), _particles.end());
+		/*The pool is fixed, overflow either drops the new particles or makes room*/
+		size_t available = particles.capacity() - particles.size();
+		if (spawn > available && _killOldest) {
+			particles.removeOldest(spawn - available, _drawOrder, _system.visible.data());
+			available = particles.capacity() - particles.size();
+		}
+		size_t first = particles.size();
+		for (particleEmitter &emitter : _emitters) {
+			size_t emitted = std::min((size_t)floor(emitter.spawnCount), available);
+			emitter.spawnCount -= floor(emitter.spawnCount);
+			for (size_t i = 0; i < emitted; i++)
+				generateParticle(emitter, elapsedTime, seconds);
+			available -= emitted;
 		}
 
-		/*Z Order*/
-		const auto zOrder = [](transformAlpha a, transformAlpha b) {
-			return a.pos.z > b.pos.z;
-		};
-
-		/*Transform*/
-		vec3 zeroed;
-		vec3_zero(&zeroed);
-		std::for_each(_particles.begin(), _particles.end(), [&zeroed](transformAlpha &p) {
-			matrix4_mul(&p.position, &p.position, &p.transform);
-			//cache position for z ordering
-			vec3_transform(&p.pos, &zeroed, &p.position);
-		});
-
-		float w = 1.0f;
-		float h = 1.0f;
-		vec4 verts[4] = { 0,0,0,0 };
-		vec4_set(&verts[0], -w / 2.0, -h / 2.0, 0, 0);
-		vec4_set(&verts[1], w / 2.0, -h / 2.0, 0, 0);
-		vec4_set(&verts[2], -w / 2.0, h / 2.0, 0, 0);
-		vec4_set(&verts[3], w / 2.0, h / 2.0, 0, 0);
-
-		std::vector<transformAlpha>::iterator it = std::partition(_particles.begin(),
-			_particles.end(), [&verts](transformAlpha &p) {
-			bool in_view = false;
-			for (int j = 0; j < 4; j++) {
-				vec3_transform(&p.v.ptr[j], (vec3*)&verts[j], &p.position);
-				in_view = in_view || (p.alpha > 0) && (fabsf(p.v.ptr[j].x) <= 1.0 &&
-					fabsf(p.v.ptr[j].y) <= 1.0);
-			}
-
-			return in_view;
-		});
+		/*New particles take their first step here*/
+		size_t count = particles.size();
+		_system.simulate(first, count, seconds, rate);
+		_system.despawn(first);
 
-		if (_despawnOutOfView) {
-			_particles.erase(it, _particles.end());
-			std::stable_sort(_particles.begin(), _particles.end(), zOrder);
-		} else {
-			std::stable_sort(_particles.begin(), it, zOrder);
-		}
+		/*Z Order, sort indices instead of moving whole particles*/
+		size_t visibleCount = _system.drawOrder(_drawOrder, _sortScratch, _sortParticles);
 
-		if (_particles.size() == 0) {
-			obs_leave_graphics();
+		_drawCount = _drawOrder.size();
+		_bounds[0] = _bounds[1] = FLT_MAX;
+		_bounds[2] = _bounds[3] = -FLT_MAX;
+		if (_drawCount == 0)
 			return;
-		}
 
-		gs_vb_data *vb;
-		if (!_vertexBufferData || oldSize != _particles.size()) {
-			if (_vertexBuffer) {
-				gs_vertexbuffer_destroy(_vertexBuffer);
-				_vertexBuffer = nullptr;
-			}
-			// Allocate memory for data.
-			size_t vCap = 4 * _particles.size();
-			if (!_vertexBufferData) {
-				_vertexBufferData = (struct gs_vb_data*)bzalloc(sizeof(struct gs_vb_data));
-			}
-			_vertexBufferData->num = vCap;
-
-			if (oldSize < _particles.size() || _vertexBufferData->num_tex == 0) {
-				_vertexBufferData->points = (vec3*)brealloc(_vertexBufferData->points, sizeof(vec3) * _vertexBufferData->num);
-				_vertexBufferData->normals = (vec3*)brealloc(_vertexBufferData->normals, sizeof(vec3) * _vertexBufferData->num);
-				_vertexBufferData->tangents = (vec3*)brealloc(_vertexBufferData->tangents, sizeof(vec3) * _vertexBufferData->num);
-				_vertexBufferData->colors = (uint32_t*)brealloc(_vertexBufferData->colors, sizeof(uint32_t) * _vertexBufferData->num);
-
-				if (!_vertexBufferData->tvarray)
-					_vertexBufferData->tvarray = (gs_tvertarray*)bzalloc(sizeof(gs_tvertarray));
-				_vertexBufferData->tvarray->array = (vec4*)brealloc(_vertexBufferData->tvarray->array, sizeof(vec4) * _vertexBufferData->num);
-				vec4 *ar = (vec4*)_vertexBufferData->tvarray->array;
-				for (size_t i = 0; i < _vertexBufferData->num;) {
-					vec4_set(&ar[i++], 0, 0, 0, 0);
-					vec4_set(&ar[i++], 1, 0, 0, 0);
-					vec4_set(&ar[i++], 0, 1, 0, 0);
-					vec4_set(&ar[i++], 1, 1, 0, 0);
-				}
-				_vertexBufferData->tvarray->width = 4;
-				_vertexBufferData->num_tex = 1;
+		/*Buffers only grow, geometrically, so steady state allocates nothing.
+		  Growth stops at max_particles so the texture stays within its row limit*/
+		if (_drawCount > _instanceCapacity) {
+			size_t capacity = std::min(std::max(_drawCount, _instanceCapacity * 2),
+					std::max(_drawCount, _maxParticleCount));
+			capacity = (capacity + PARTICLE_INSTANCE_ROW - 1) / PARTICLE_INSTANCE_ROW * PARTICLE_INSTANCE_ROW;
+			obs_enter_graphics();
+			if (_instanceTexture)
+				gs_texture_destroy(_instanceTexture);
+			_instanceTexture = gs_texture_create(PARTICLE_INSTANCE_ROW * PARTICLE_INSTANCE_TEXELS,
+					(uint32_t)(capacity / PARTICLE_INSTANCE_ROW), GS_RGBA32F, 1, NULL, GS_DYNAMIC);
+			_instanceCapacity = _instanceTexture ? capacity : 0;
+			reserveParticleQuads(capacity);
+			obs_leave_graphics();
+			if (!_instanceTexture) {
+				_drawCount = 0;
+				return;
 			}
-
-			vb = _vertexBufferData;
-		} else {
-			vb = (gs_vb_data *)gs_vertexbuffer_get_data(_vertexBuffer);
+			_instanceData.resize(capacity * PARTICLE_INSTANCE_SIZE);
 		}
 
-		for (size_t i = 0; i < _particles.size(); i++) {
-			transformAlpha *p = &_particles[i];
-			float alpha = p->alpha / 255.0;
-			size_t row = i * 4;
-			for (size_t j = 0; j < 4; j++) {
-				vec3_set(&vb->normals[row + j], alpha, alpha, alpha);
-				vec3_copy(&vb->points[row + j], &p->v.ptr[j]);
-			}
-		}
+		/*Fill the instance stream in draw order, the upload happens at render*/
+		particle_fill_instances(particleSimulation->pool(), particles, _drawOrder.data(), _drawCount,
+				visibleCount, _instanceData.data(), _bounds);
+	}
 
-		if (!_vertexBuffer) {
-			_vertexBuffer = gs_vertexbuffer_create(_vertexBufferData, GS_DYNAMIC | GS_DUP_BUFFER);
-		} else {
-			if (oldSize != _particles.size()) {
-				if (_vertexBuffer) {
-					gs_vertexbuffer_destroy(_vertexBuffer);
-					_vertexBuffer = nullptr;
-				}
-				_vertexBuffer = gs_vertexbuffer_create(_vertexBufferData, GS_DYNAMIC | GS_DUP_BUFFER);
-			}
-		}
+	/* Uploads the rows of the instance texture holding live particles */
+	void uploadInstances()
+	{
+		uint8_t *ptr;
+		uint32_t linesize;
+		if (!gs_texture_map(_instanceTexture, &ptr, &linesize))
+			return;
+		size_t rows = (_drawCount + PARTICLE_INSTANCE_ROW - 1) / PARTICLE_INSTANCE_ROW;
+		size_t rowSize = sizeof(float) * PARTICLE_INSTANCE_SIZE * PARTICLE_INSTANCE_ROW;
+		const uint8_t *src = (const uint8_t *)_instanceData.data();
+		for (size_t y = 0; y < rows; y++)
+			memcpy(ptr + y * linesize, src + y * rowSize, rowSize);
+		gs_texture_unmap(_instanceTexture);
+	}
 
-		if (!_indexBuffer) {
-			indexBuffer(_indexBufferData, (uint32_t)_particles.size());
-			_indexBuffer = gs_indexbuffer_create(gs_index_type::GS_UNSIGNED_LONG, _indexBufferData.data(), _particles.size() * 6, GS_DYNAMIC | GS_DUP_BUFFER);
-		} else {
-			if (_particles.size() > oldSize) {
-				gs_indexbuffer_destroy(_indexBuffer);
-				indexBuffer(_indexBufferData, (uint32_t)_particles.size());
-				_indexBuffer = gs_indexbuffer_create(gs_index_type::GS_UNSIGNED_LONG, _indexBufferData.data(), _particles.size() * 6, GS_DYNAMIC | GS_DUP_BUFFER);
-			}
-		}
-		obs_leave_graphics();
+	/* Pixel rect (x0, y0, x1, y1) covered by the particle bounds, all zero when empty */
+	void particleRect(int *rect, uint32_t w, uint32_t h)
+	{
+		rect[0] = (int)hlsl_clamp(floor((_bounds[0] + 1.0) * 0.5 * w), 0, w);
+		rect[1] = (int)hlsl_clamp(floor((_bounds[1] + 1.0) * 0.5 * h), 0, h);
+		rect[2] = (int)hlsl_clamp(ceil((_bounds[2] + 1.0) * 0.5 * w), 0, w);
+		rect[3] = (int)hlsl_clamp(ceil((_bounds[3] + 1.0) * 0.5 * h), 0, h);
+		if (rect[0] >= rect[2] || rect[1] >= rect[3])
+			rect[0] = rect[1] = rect[2] = rect[3] = 0;
+	}
+
+	/* Restricts drawing to rect while keeping the whole target's clip space */
+	void particleView(const int *rect, uint32_t w, uint32_t h)
+	{
+		gs_set_viewport(rect[0], rect[1], rect[2] - rect[0], rect[3] - rect[1]);
+		gs_ortho(2.0f * rect[0] / w - 1.0f, 2.0f * rect[2] / w - 1.0f, 2.0f * rect[1] / h - 1.0f,
+				2.0f * rect[3] / h - 1.0f, -farZ, farZ);
 	}
 
 	void videoRender(ShaderSource *filter)
@@ -2111,8 +2710,7 @@ public:
 		switch (_texType) {
 		case media:
 		case source:
-			renderSource(srcWidth, srcHeight);
-			t = gs_texrender_get_texture(_texrender);
+			t = renderSource(srcWidth, srcHeight);
 			break;
 		case audio:
 			renderAudioSource(AUDIO_OUTPUT_FRAMES);
@@ -2124,6 +2722,9 @@ public:
 		case buffer:
 			t = _tex;
 			break;
+		case target:
+			t = _targets[_targetFront] ? gs_texrender_get_texture(_targets[_targetFront]) : nullptr;
+			break;
 		default:
 			break;
 		}
@@ -2133,30 +2734,71 @@ public:
 				_particlerender = gs_texrender_create(GS_RGBA, GS_ZS_NONE);
 
 			gs_texture_t *tex = nullptr;
-			if (gs_texrender_begin(_particlerender, _filter->totalWidth, _filter->totalHeight)) {
+			uint32_t w = std::max(1u, (uint32_t)round(_filter->totalWidth * _particleScale));
+			uint32_t h = std::max(1u, (uint32_t)round(_filter->totalHeight * _particleScale));
+			bool resized = w != _particleWidth || h != _particleHeight;
+			int rect[4];
+			particleRect(rect, w, h);
+			if (gs_texrender_begin(_particlerender, w, h)) {
 				gs_set_cull_mode(GS_NEITHER);
 				gs_enable_depth_test(false);
 				gs_depth_function(gs_depth_test::GS_ALWAYS);
 				gs_ortho(-1.0, 1.0, -1.0, 1.0, -farZ, farZ);
 				gs_enable_color(true, true, true, true);
 
-				struct vec4 clearColor;
-				vec4_zero(&clearColor);
-
-				gs_clear(GS_CLEAR_COLOR | GS_CLEAR_DEPTH, &clearColor, farZ, 0);
-				
-
-				if (_particles.size() > 0) {
-					if (t && _vertexBuffer && _indexBuffer) {
-						uint32_t vertexes = 6 * (uint32_t)_particles.size();
-
-						gs_vertexbuffer_flush(_vertexBuffer);
-						gs_load_vertexbuffer(_vertexBuffer);
-						gs_indexbuffer_flush(_indexBuffer);
-						gs_load_indexbuffer(_indexBuffer);
-						const char *techName = "Draw";
-						gs_technique_t *tech = gs_effect_get_technique(default_effect, techName);
-						gs_effect_set_texture(gs_effect_get_param_by_name(default_effect, "image"), t);
+				if (resized || !particle_effect || !particleQuadBuffer || !particleIndexBuffer) {
+					struct vec4 clearColor;
+					vec4_zero(&clearColor);
+					gs_clear(GS_CLEAR_COLOR | GS_CLEAR_DEPTH, &clearColor, farZ, 0);
+					_particleWidth = w;
+					_particleHeight = h;
+				} else {
+					/*gs_clear ignores the viewport, a quad clears last frame's and this frame's area*/
+					int clear[4] = { rect[0], rect[1], rect[2], rect[3] };
+					if (_drawnRect[0] < _drawnRect[2]) {
+						if (clear[0] < clear[2]) {
+							clear[0] = std::min(clear[0], _drawnRect[0]);
+							clear[1] = std::min(clear[1], _drawnRect[1]);
+							clear[2] = std::max(clear[2], _drawnRect[2]);
+							clear[3] = std::max(clear[3], _drawnRect[3]);
+						} else {
+							memcpy(clear, _drawnRect, sizeof(clear));
+						}
+					}
+					if (clear[0] < clear[2]) {
+						particleView(clear, w, h);
+						gs_blend_state_push();
+						gs_enable_blending(false);
+						gs_load_vertexbuffer(particleQuadBuffer);
+						gs_load_indexbuffer(particleIndexBuffer);
+						gs_technique_t *tech = particle.clear;
+						size_t passes = gs_technique_begin(tech);
+						for (i = 0; i < passes; i++) {
+							gs_technique_begin_pass(tech, i);
+							gs_draw(GS_TRIS, 0, 6);
+							gs_technique_end_pass(tech);
+						}
+						gs_technique_end(tech);
+						gs_blend_state_pop();
+					}
+				}
+				memcpy(_drawnRect, rect, sizeof(rect));
+
+				if (_drawCount > 0 && rect[0] < rect[2]) {
+					if (t && _instanceTexture && particleQuadBuffer && particleIndexBuffer && particle_effect) {
+						uint32_t vertexes = 6 * (uint32_t)_drawCount;
+
+						uploadInstances();
+						particleView(rect, w, h);
+						gs_load_vertexbuffer(particleQuadBuffer);
+						gs_load_indexbuffer(particleIndexBuffer);
+						gs_technique_t *tech = particle.draw;
+						gs_effect_set_texture(particle.image, t);
+						gs_effect_set_texture(particle.instances, _instanceTexture);
+						struct vec2 atlasSize;
+						vec2_set(&atlasSize, (float)_atlasColumns, (float)_atlasRows);
+						gs_effect_set_vec2(particle.atlasSize, &atlasSize);
+						gs_effect_set_float(particle.atlasFps, _atlasFps);
 						size_t passes = gs_technique_begin(tech);
 						for (i = 0; i < passes; i++) {
 							gs_technique_begin_pass(tech, i);
@@ -2212,26 +2854,62 @@ public:
 		_bufferCopied = true;
 	}
 
-	void onPass(ShaderSource *filter, const char *technique, size_t pass, gs_texture_t *texture)
+	void onPass(ShaderSource *filter, gs_technique_t *technique, size_t pass, gs_texture_t *texture)
 	{
 		UNUSED_PARAMETER(filter);
-		if (_texType == buffer) {
-			std::string tech = technique;
-			if (tech == _tech && pass == _pass) {
-				copyBuffer(texture);
-			}
-		}
+		if (_texType == buffer && _technique && technique == _technique && pass == _pass)
+			copyBuffer(texture);
 	}
 
-	void onTechniqueEnd(ShaderSource *filter, const char *technique, gs_texture_t *texture)
+	void onTechniqueEnd(ShaderSource *filter, gs_technique_t *technique, gs_texture_t *texture)
 	{
 		UNUSED_PARAMETER(filter);
-		if (_texType == buffer) {
-			std::string tech = technique;
-			if (tech == _tech && _pass == -1) {
-				copyBuffer(texture);
-			}
-		}
+		if (_texType == buffer && _technique && technique == _technique && _pass == -1)
+			copyBuffer(texture);
+	}
+
+	bool beginPass(ShaderSource *filter, gs_technique_t *technique, size_t pass, uint32_t cx, uint32_t cy)
+	{
+		UNUSED_PARAMETER(filter);
+		if (_texType != target || !_technique || technique != _technique ||
+				std::find(_targetPasses.begin(), _targetPasses.end(), pass) == _targetPasses.end())
+			return false;
+
+		gs_texrender_t *&back = _targets[_targetFront ^ 1];
+		if (!back)
+			back = gs_texrender_create(_targetFormat, GS_ZS_NONE);
+		uint32_t w = std::max(1u, (uint32_t)round(cx * _targetScale));
+		uint32_t h = std::max(1u, (uint32_t)round(cy * _targetScale));
+		gs_texrender_reset(back);
+		if (!gs_texrender_begin(back, w, h))
+			return false;
+
+		gs_blend_state_push();
+		gs_blend_function(GS_BLEND_ONE, GS_BLEND_ZERO);
+		struct vec4 clearColor;
+		vec4_zero(&clearColor);
+		gs_clear(GS_CLEAR_COLOR, &clearColor, 0.0f, 0);
+		/*The sprite keeps the output's size, the projection scales it to the target*/
+		gs_ortho(0.0f, (float)cx, 0.0f, (float)cy, -100.0f, 100.0f);
+		return true;
+	}
+
+	uint32_t phases()
+	{
+		uint32_t phases = PARAM_TICK | PARAM_RENDER | PARAM_UPDATE;
+		if (_texType == buffer || _texType == target)
+			phases |= PARAM_PASS;
+		return phases;
+	}
+
+	void endPass(ShaderSource *filter)
+	{
+		UNUSED_PARAMETER(filter);
+		gs_blend_state_pop();
+		gs_texrender_end(_targets[_targetFront ^ 1]);
+		_targetFront ^= 1;
+		gs_texture_t *t = gs_texrender_get_texture(_targets[_targetFront]);
+		_param->setValue<gs_texture_t *>(&t, sizeof(gs_texture_t *));
 	}
 };
 
@@ -2365,18 +3043,34 @@ void ShaderParameter::getProperties(ShaderSource *filter, obs_properties_t *prop
 		_shaderData->getProperties(filter, props);
 }
 
-void ShaderParameter::onPass(ShaderSource *filter, const char *technique, size_t pass, gs_texture_t *texture)
+void ShaderParameter::onPass(ShaderSource *filter, gs_technique_t *technique, size_t pass, gs_texture_t *texture)
 {
 	if (_shaderData)
 		_shaderData->onPass(filter, technique, pass, texture);
 }
 
-void ShaderParameter::onTechniqueEnd(ShaderSource *filter, const char *technique, gs_texture_t *texture)
+void ShaderParameter::onTechniqueEnd(ShaderSource *filter, gs_technique_t *technique, gs_texture_t *texture)
 {
 	if (_shaderData)
 		_shaderData->onTechniqueEnd(filter, technique, texture);
 }
 
+bool ShaderParameter::beginPass(ShaderSource *filter, gs_technique_t *technique, size_t pass, uint32_t cx, uint32_t cy)
+{
+	return _shaderData && _shaderData->beginPass(filter, technique, pass, cx, cy);
+}
+
+void ShaderParameter::endPass(ShaderSource *filter)
+{
+	if (_shaderData)
+		_shaderData->endPass(filter);
+}
+
+uint32_t ShaderParameter::phases()
+{
+	return _shaderData ? _shaderData->phases() : 0;
+}
+
 obs_data_t *ShaderSource::getSettings()
 {
 	return _settings;
@@ -2412,6 +3106,16 @@ void ShaderSource::clearExpression()
 	expression.clear();
 }
 
+void ShaderSource::advanceExpressionState(double seconds)
+{
+	_expressionState.advance(seconds);
+}
+
+ExpressionState *ShaderSource::getExpressionState()
+{
+	return &_expressionState;
+}
+
 void ShaderSource::appendVariable(te_variable var)
 {
 	if (!expression.hasVariable(std::string(var.name))) {
@@ -2445,9 +3149,9 @@ void ShaderSource::appendVariable(std::string &name, double *binding)
 	}
 }
 
-void ShaderSource::compileExpression(std::string expr)
+void ShaderSource::compileExpression(std::string expr, const void *owner)
 {
-	expression.compile(expr);
+	expression.compile(expr, owner);
 	if (!expressionCompiled()) {
 		blog(LOG_WARNING, "%s failed to compile %s",
 				getType() == OBS_SOURCE_TYPE_FILTER ?
@@ -2469,15 +3173,253 @@ std::string ShaderSource::expressionError()
 
 template<class DataType> DataType ShaderSource::evaluateExpression(DataType default_value)
 {
+	ProfileScope profile(profiler(), PROFILE_EXPRESSIONS);
 	return expression.evaluate(default_value);
 }
 
+std::string ShaderSource::expressionProfile()
+{
+	std::string summary;
+	char        line[128];
+	for (const auto &it : expression.profile()) {
+		const expression_stats &stats = it.second;
+		snprintf(line, sizeof(line), "%llu calls, %llu ns/call, %d nodes: ",
+				(unsigned long long)stats.calls,
+				(unsigned long long)(stats.samples ? stats.sampledNs / stats.samples : 0),
+				stats.nodes);
+		summary += line + it.first + "\n";
+	}
+	return summary;
+}
+
+std::string ShaderSource::publishedExpressionProfile()
+{
+	std::lock_guard<std::mutex> lock(_profileMutex);
+	return _expressionProfileText;
+}
+
+/* Runs on the video thread, the only one touching the expression statistics */
+void ShaderSource::logExpressionProfile(float seconds)
+{
+	expression.setProfiling(_profileExpressions.load(std::memory_order_relaxed));
+	if (!expression.profiling())
+		return;
+	_profilePublishTime += seconds;
+	if (_profilePublishTime >= 1.0f) {
+		_profilePublishTime = 0;
+		std::string summary = expressionProfile();
+		std::lock_guard<std::mutex> lock(_profileMutex);
+		_expressionProfileText = std::move(summary);
+	}
+	_profileLogTime += seconds;
+	if (_profileLogTime < 10.0f)
+		return;
+	_profileLogTime = 0;
+	blog(LOG_INFO, "expression profile for '%s':\n%s", obs_source_get_name(context),
+			expressionProfile().c_str());
+}
+
+static const char *profilePhaseNames[PROFILE_PHASES] = { "tick", "render", "expressions", "audio", "particles" };
+
+std::string ShaderSource::renderProfileSummary()
+{
+	std::string summary;
+	char        line[128];
+	for (size_t i = 0; i < PROFILE_PHASES; i++) {
+		uint64_t calls = renderProfile.calls[i].load(std::memory_order_relaxed);
+		uint64_t ns = renderProfile.ns[i].load(std::memory_order_relaxed);
+		snprintf(line, sizeof(line), "%s: %llu calls, %.1f us/call\n", profilePhaseNames[i],
+				(unsigned long long)calls, calls ? ns / 1000.0 / calls : 0.0);
+		summary += line;
+	}
+	for (size_t i = 0; i < PROFILE_MAX_PASSES; i++) {
+		uint64_t calls = renderProfile.gpuCalls[i].load(std::memory_order_relaxed);
+		uint64_t ns = renderProfile.gpuNs[i].load(std::memory_order_relaxed);
+		if (!calls)
+			continue;
+		snprintf(line, sizeof(line), "gpu pass %zu: %llu samples, %.1f us/pass\n", i,
+				(unsigned long long)calls, ns / 1000.0 / calls);
+		summary += line;
+	}
+	return summary;
+}
+
+/* A row of the timing csv, written and freed on profileWriter */
+struct profile_row {
+	std::string path;
+	std::string header;
+	std::string row;
+};
+
+static void writeProfileRow(void *data)
+{
+	profile_row *row = static_cast<profile_row *>(data);
+	bool         exists = os_file_exists(row->path.c_str());
+	FILE        *file = os_fopen(row->path.c_str(), "a");
+	if (file) {
+		if (!exists)
+			fputs(row->header.c_str(), file);
+		fputs(row->row.c_str(), file);
+		fclose(file);
+	} else {
+		blog(LOG_WARNING, "could not open '%s' for the render profile", row->path.c_str());
+	}
+	delete row;
+}
+
+/* Formats the averages every 10 seconds and starts over, the file is written
+ * off the video thread */
+void ShaderSource::writeRenderProfile(float seconds)
+{
+	if (!_profileRender)
+		return;
+	_profileCsvTime += seconds;
+	if (_profileCsvTime < 10.0f)
+		return;
+	_profileCsvTime = 0;
+
+	profile_row *row = new profile_row();
+	{
+		std::lock_guard<std::mutex> lock(_profileMutex);
+		row->path = _profileCsvPath;
+	}
+	if (row->path.empty() || !profileWriter) {
+		delete row;
+		return;
+	}
+
+	char   field[128];
+	size_t i;
+	row->header = "time_ns,source";
+	for (i = 0; i < PROFILE_PHASES; i++) {
+		snprintf(field, sizeof(field), ",%s_calls,%s_us", profilePhaseNames[i], profilePhaseNames[i]);
+		row->header += field;
+	}
+	for (i = 0; i < PROFILE_MAX_PASSES; i++) {
+		snprintf(field, sizeof(field), ",gpu_pass_%zu_us", i);
+		row->header += field;
+	}
+	row->header += "\n";
+
+	snprintf(field, sizeof(field), "%llu,", (unsigned long long)os_gettime_ns());
+	row->row = field;
+	row->row += "\"";
+	row->row += obs_source_get_name(context);
+	row->row += "\"";
+	for (i = 0; i < PROFILE_PHASES; i++) {
+		uint64_t calls = renderProfile.calls[i].load(std::memory_order_relaxed);
+		uint64_t ns = renderProfile.ns[i].load(std::memory_order_relaxed);
+		snprintf(field, sizeof(field), ",%llu,%.2f", (unsigned long long)calls,
+				calls ? ns / 1000.0 / calls : 0.0);
+		row->row += field;
+	}
+	for (i = 0; i < PROFILE_MAX_PASSES; i++) {
+		uint64_t calls = renderProfile.gpuCalls[i].load(std::memory_order_relaxed);
+		uint64_t ns = renderProfile.gpuNs[i].load(std::memory_order_relaxed);
+		snprintf(field, sizeof(field), ",%.2f", calls ? ns / 1000.0 / calls : 0.0);
+		row->row += field;
+	}
+	row->row += "\n";
+	renderProfile.reset();
+
+	if (!os_task_queue_queue_task(profileWriter, writeProfileRow, row))
+		delete row;
+}
+
+void ShaderSource::beginPassTimer(size_t pass)
+{
+	if (!_profileRender || pass >= PROFILE_MAX_PASSES)
+		return;
+	if (_passTimers.size() <= pass)
+		_passTimers.resize(pass + 1);
+	gpu_pass_timer &timers = _passTimers[pass];
+	size_t          slot = timers.next;
+
+	/* Collect the query issued PROFILE_TIMER_LATENCY frames ago, unready ones are dropped */
+	if (timers.pending[slot]) {
+		bool     disjoint = true;
+		uint64_t frequency = 0;
+		uint64_t ticks = 0;
+		if (gs_timer_range_get_data(timers.range[slot], &disjoint, &frequency) && !disjoint && frequency &&
+				gs_timer_get_data(timers.timer[slot], &ticks))
+			renderProfile.addGpu(pass, (uint64_t)(ticks * (1000000000.0 / frequency)));
+		timers.pending[slot] = false;
+	}
+	if (!timers.range[slot])
+		timers.range[slot] = gs_timer_range_create();
+	if (!timers.timer[slot])
+		timers.timer[slot] = gs_timer_create();
+	if (!timers.range[slot] || !timers.timer[slot])
+		return;
+	gs_timer_range_begin(timers.range[slot]);
+	gs_timer_begin(timers.timer[slot]);
+}
+
+void ShaderSource::endPassTimer(size_t pass)
+{
+	if (!_profileRender || pass >= _passTimers.size())
+		return;
+	gpu_pass_timer &timers = _passTimers[pass];
+	size_t          slot = timers.next;
+	if (!timers.range[slot] || !timers.timer[slot])
+		return;
+	gs_timer_end(timers.timer[slot]);
+	gs_timer_range_end(timers.range[slot]);
+	timers.pending[slot] = true;
+	timers.next = (slot + 1) % PROFILE_TIMER_LATENCY;
+}
+
+/* Expects the graphics context to be entered */
+void ShaderSource::destroyPassTimers()
+{
+	for (gpu_pass_timer &timers : _passTimers) {
+		for (size_t i = 0; i < PROFILE_TIMER_LATENCY; i++) {
+			gs_timer_range_destroy(timers.range[i]);
+			gs_timer_destroy(timers.timer[i]);
+		}
+	}
+	_passTimers.clear();
+}
+
+/* Expects the graphics context to be entered */
+void ShaderSource::destroyOutputCache()
+{
+	for (size_t i = 0; i < 2; i++) {
+		gs_texrender_destroy(_outputCache[i]);
+		_outputCache[i] = nullptr;
+	}
+	_outputCount = 0;
+	_outputDirty = true;
+}
+
+void ShaderSource::compileVectorExpression(std::string expr, const void *owner)
+{
+	expression.compileVector(expr, owner);
+	if (!vectorExpressionCompiled()) {
+		blog(LOG_WARNING, "%s failed to compile %s",
+				getType() == OBS_SOURCE_TYPE_FILTER ?
+				obs_source_get_name(obs_filter_get_parent(context)) :
+				obs_source_get_name(context),
+				expr.c_str());
+	}
+}
+
+size_t ShaderSource::evaluateVectorExpression(double *out, size_t count)
+{
+	ProfileScope profile(profiler(), PROFILE_EXPRESSIONS);
+	return expression.evaluateVector(out, count);
+}
+
+bool ShaderSource::vectorExpressionCompiled()
+{
+	return expression.vectorSuccess();
+}
+
 ShaderSource::ShaderSource(obs_data_t *settings, obs_source_t *source)
 {
 	paramList = {};
 	paramMap = {};
 	evaluationList = {};
-	expression = {};
 	elapsedTimeBinding.s64i = 0;
 	context = source;
 	_source_type = obs_source_get_type(source);
@@ -2500,8 +3442,8 @@ ShaderSource::~ShaderSource()
 	obs_enter_graphics();
 	gs_effect_destroy(effect);
 	effect = nullptr;
-	gs_texrender_destroy(filterTexrender);
-	filterTexrender = nullptr;
+	destroyPassTimers();
+	destroyOutputCache();
 	obs_leave_graphics();
 
 	if (_mutex)
@@ -2536,6 +3478,15 @@ void ShaderSource::updateCache(gs_eparam_t *param)
 		return;
 	paramList.push_back(p);
 	paramMap.insert(std::pair<std::string, ShaderParameter *>(p->getName(), p));
+	uint32_t phases = p->phases();
+	if (phases & PARAM_TICK)
+		tickList.push_back(p);
+	if (phases & PARAM_RENDER)
+		renderList.push_back(p);
+	if (phases & PARAM_UPDATE)
+		updateList.push_back(p);
+	if (phases & PARAM_PASS)
+		passList.push_back(p);
 	blog(LOG_INFO, "%s", p->getName().c_str());
 }
 
@@ -2551,12 +3502,23 @@ void ShaderSource::reload()
 		paramList.pop_back();
 		delete p;
 	}
-	for (i = 0; i < resizeExpressions->size(); i++)
+	for (i = 0; i < 4; i++)
 		resizeExpressions[i] = "";
+	directRender = false;
+	/* Defaults a previous shader's annotations set, before any early return */
+	obs_data_set_default_double(_settings, "render_scale", 1.0);
+	obs_data_set_default_string(_settings, "render_upsample", "Bilinear");
+	obs_data_set_default_double(_settings, "update_rate", 0.0);
+	obs_data_set_default_bool(_settings, "update_interpolate", false);
 	paramMap.clear();
 	evaluationList.clear();
+	tickList.clear();
+	renderList.clear();
+	updateList.clear();
+	passList.clear();
 	expression.releaseExpression();
 	expression.clear();
+	_expressionState.reset();
 
 	prepFunctions(&expression, this);
 	/* Enforce alphabetical order for binary search */
@@ -2569,6 +3531,7 @@ void ShaderSource::reload()
 	obs_enter_graphics();
 	gs_effect_destroy(effect);
 	effect = nullptr;
+	drawTechnique = nullptr;
 	obs_leave_graphics();
 
 	_effectPath = obs_data_get_string(_settings, "shader_file_name");
@@ -2584,12 +3547,14 @@ void ShaderSource::reload()
 
 	obs_enter_graphics();
 	effect = gs_effect_create(effect_string, NULL, &errors);
+	drawTechnique = effect ? gs_effect_get_technique(effect, "Draw") : nullptr;
 	obs_leave_graphics();
 
 	_effectString = effect_string;
 	bfree(effect_string);
 
 	/* Create new parameters */
+	directRender = effect != nullptr;
 	size_t effect_count = gs_effect_get_num_params(effect);
 	paramList.reserve(effect_count + paramList.size());
 	paramMap.reserve(effect_count + paramList.size());
@@ -2618,6 +3583,25 @@ void ShaderSource::reload()
 		mapParam(&image, "image_0");
 
 	mapParam(&image_1, "image_1");
+
+	/* Drawing the target directly needs a single pass over the target's own
+	   "image" at its own size, opted into with direct_render, every frame
+	   rechecks the size */
+	for (i = 0; i < 4; i++) {
+		if (!resizeExpressions[i].empty())
+			directRender = false;
+	}
+	if (!paramMap.count("image"))
+		directRender = false;
+	if (directRender) {
+		obs_enter_graphics();
+		size_t passes = drawTechnique ? gs_technique_begin(drawTechnique) : 0;
+		if (drawTechnique)
+			gs_technique_end(drawTechnique);
+		obs_leave_graphics();
+		directRender = passes == 1;
+	}
+	blog(LOG_INFO, "%s direct rendering", directRender ? "Using" : "Not using");
 }
 
 void *ShaderSource::create(obs_data_t *settings, obs_source_t *source)
@@ -2640,8 +3624,10 @@ const char *ShaderSource::getName(void *unused)
 void ShaderSource::videoTick(void *data, float seconds)
 {
 	ShaderSource *filter = static_cast<ShaderSource *>(data);
+	ProfileScope  profile(filter->profiler(), PROFILE_TICK);
 	filter->elapsedTimeBinding.d += seconds;
 	filter->elapsedTime += seconds;
+	filter->advanceExpressionState(seconds);
 
 	getMouseCursor(filter);
 	getScreenSizes(filter);
@@ -2651,16 +3637,14 @@ void ShaderSource::videoTick(void *data, float seconds)
 	frame_rate = ((double)voi.fps_num / (double)voi.fps_den);
 
 	size_t i;
-	for (i = 0; i < filter->paramList.size(); i++) {
-		if (filter->paramList[i])
-			filter->paramList[i]->videoTick(filter, filter->elapsedTime, seconds);
-	}
+	for (i = 0; i < filter->tickList.size(); i++)
+		filter->tickList[i]->videoTick(filter, filter->elapsedTime, seconds);
 
 	int *resize[4] = { &filter->resizeLeft, &filter->resizeRight, &filter->resizeTop, &filter->resizeBottom };
 	for (i = 0; i < 4; i++) {
 		if (filter->resizeExpressions[i].empty())
 			continue;
-		filter->compileExpression(filter->resizeExpressions[i]);
+		filter->compileExpression(filter->resizeExpressions[i], &filter->resizeExpressions[i]);
 		if (filter->expressionCompiled())
 			*resize[i] = filter->evaluateExpression<int>(0);
 	}
@@ -2677,22 +3661,24 @@ void ShaderSource::videoTick(void *data, float seconds)
 	filter->uvScale.y = (float)filter->totalHeight / baseHeight;
 	filter->uvOffset.x = (float)(-filter->resizeLeft) / baseWidth;
 	filter->uvOffset.y = (float)(-filter->resizeTop) / baseHeight;
-	filter->uvPixelInterval.x = 1.0f / baseWidth;
-	filter->uvPixelInterval.y = 1.0f / baseHeight;
+	filter->uvPixelInterval.x = 1.0f / (baseWidth * renderScaleOf(filter));
+	filter->uvPixelInterval.y = 1.0f / (baseHeight * renderScaleOf(filter));
 
 	filter->uvScaleBinding = filter->uvScale;
 	filter->uvOffsetBinding = filter->uvOffset;
 
-	if (!filter->filterTexrender)
-		filter->filterTexrender = gs_texrender_create(GS_RGBA, GS_ZS_NONE);
-	gs_texrender_reset(filter->filterTexrender);
+	filter->_outputAge += seconds;
+	filter->logExpressionProfile(seconds);
+	filter->writeRenderProfile(seconds);
 }
 
 void ShaderSource::videoTickSource(void *data, float seconds)
 {
 	ShaderSource *filter = static_cast<ShaderSource *>(data);
+	ProfileScope  profile(filter->profiler(), PROFILE_TICK);
 	filter->elapsedTimeBinding.d += seconds;
 	filter->elapsedTime += seconds;
+	filter->advanceExpressionState(seconds);
 
 	getMouseCursor(filter);
 	getScreenSizes(filter);
@@ -2702,16 +3688,14 @@ void ShaderSource::videoTickSource(void *data, float seconds)
 	frame_rate = ((double)voi.fps_num / (double)voi.fps_den);
 
 	size_t i;
-	for (i = 0; i < filter->paramList.size(); i++) {
-		if (filter->paramList[i])
-			filter->paramList[i]->videoTick(filter, filter->elapsedTime, seconds);
-	}
+	for (i = 0; i < filter->tickList.size(); i++)
+		filter->tickList[i]->videoTick(filter, filter->elapsedTime, seconds);
 
 	int *resize[4] = { &filter->resizeLeft, &filter->resizeRight, &filter->resizeTop, &filter->resizeBottom };
 	for (i = 0; i < 4; i++) {
 		if (filter->resizeExpressions[i].empty())
 			continue;
-		filter->compileExpression(filter->resizeExpressions[i]);
+		filter->compileExpression(filter->resizeExpressions[i], &filter->resizeExpressions[i]);
 		if (filter->expressionCompiled())
 			*resize[i] = filter->evaluateExpression<int>(0);
 	}
@@ -2727,15 +3711,22 @@ void ShaderSource::videoTickSource(void *data, float seconds)
 	filter->uvScale.y = (float)filter->totalHeight / baseHeight;
 	filter->uvOffset.x = (float)(-filter->resizeLeft) / baseWidth;
 	filter->uvOffset.y = (float)(-filter->resizeTop) / baseHeight;
-	filter->uvPixelInterval.x = 1.0f / baseWidth;
-	filter->uvPixelInterval.y = 1.0f / baseHeight;
+	filter->uvPixelInterval.x = 1.0f / (baseWidth * renderScaleOf(filter));
+	filter->uvPixelInterval.y = 1.0f / (baseHeight * renderScaleOf(filter));
 
 	filter->uvScaleBinding = filter->uvScale;
 	filter->uvOffsetBinding = filter->uvOffset;
 
-	if (!filter->filterTexrender)
-		filter->filterTexrender = gs_texrender_create(GS_RGBA, GS_ZS_NONE);
-	gs_texrender_reset(filter->filterTexrender);
+	filter->_outputAge += seconds;
+	filter->logExpressionProfile(seconds);
+	filter->writeRenderProfile(seconds);
+}
+
+/* Returns the filter's pooled target once its texture was drawn from */
+static inline void releaseFilterTarget(ShaderSource *filter)
+{
+	renderTargets->release(filter->filterTexrender);
+	filter->filterTexrender = nullptr;
 }
 
 void ShaderSource::videoRender(void *data, gs_effect_t *effect)
@@ -2743,6 +3734,7 @@ void ShaderSource::videoRender(void *data, gs_effect_t *effect)
 	UNUSED_PARAMETER(effect);
 	ShaderSource *filter = static_cast<ShaderSource *>(data);
 	size_t        passes, i, j;
+	ProfileScope  profile(filter->profiler(), PROFILE_RENDER);
 
 	if (filter->effect != nullptr) {
 		obs_source_t *target, *parent;
@@ -2771,23 +3763,56 @@ void ShaderSource::videoRender(void *data, gs_effect_t *effect)
 			return;
 		}
 
-		for (i = 0; i < filter->paramList.size(); i++) {
-			if (filter->paramList[i])
-				filter->paramList[i]->videoRender(filter);
-		}
+		if (renderOutputCache(filter, cx, cy))
+			return;
 
-		if (!filter->filterTexrender)
-			filter->filterTexrender = gs_texrender_create(GS_RGBA, GS_ZS_NONE);
+		for (i = 0; i < filter->renderList.size(); i++)
+			filter->renderList[i]->videoRender(filter);
 
 		const char *id = obs_source_get_id(parent);
 		parentFlags = obs_get_source_output_flags(id);
+		bool customDraw = (parentFlags & OBS_SOURCE_CUSTOM_DRAW) != 0;
+		bool async = (parentFlags & OBS_SOURCE_ASYNC) != 0;
+
+		/*Sources drawing a single sprite with the current effect can draw straight
+		  through the filter instead of into filterTexrender first*/
+		enum obs_allow_direct_render allowBypass = filter->directRender && renderScaleOf(filter) >= 1.0f &&
+				filter->updateRate <= 0.0f &&
+				cx == obs_source_get_base_width(target) && cy == obs_source_get_base_height(target) ?
+				OBS_ALLOW_DIRECT_RENDERING : OBS_NO_DIRECT_RENDERING;
+		bool canBypass = (target == parent) && (allowBypass == OBS_ALLOW_DIRECT_RENDERING) && !customDraw &&
+			!async;
+
+		if (canBypass) {
+			gs_technique_t *tech = filter->drawTechnique;
+			texture = nullptr;
+
+			bool timed = filter->profiler() != nullptr;
+			passes = gs_technique_begin(tech);
+			for (i = 0; i < passes; i++) {
+				if (timed)
+					filter->beginPassTimer(i);
+				gs_technique_begin_pass(tech, i);
+				obs_source_video_render(target);
+				gs_technique_end_pass(tech);
+				if (timed)
+					filter->endPassTimer(i);
+				/*Handle Buffers*/
+				for (j = 0; j < filter->passList.size(); j++)
+					filter->passList[j]->onPass(filter, tech, i, texture);
+			}
+			gs_technique_end(tech);
+			for (j = 0; j < filter->passList.size(); j++)
+				filter->passList[j]->onTechniqueEnd(filter, tech, texture);
+			return;
+		}
+
+		filter->filterTexrender = renderTargets->acquire(cx, cy);
 
 		gs_blend_state_push();
 		gs_blend_function(GS_BLEND_ONE, GS_BLEND_ZERO);
 
 		if (gs_texrender_begin(filter->filterTexrender, cx, cy)) {
-			bool        customDraw = (parentFlags & OBS_SOURCE_CUSTOM_DRAW) != 0;
-			bool        async = (parentFlags & OBS_SOURCE_ASYNC) != 0;
 			struct vec4 clearColor;
 
 			vec4_zero(&clearColor);
@@ -2804,38 +3829,14 @@ void ShaderSource::videoRender(void *data, gs_effect_t *effect)
 
 		gs_blend_state_pop();
 
-		enum obs_allow_direct_render allowBypass = OBS_NO_DIRECT_RENDERING;
-		bool canBypass = (target == parent) && (allowBypass == OBS_ALLOW_DIRECT_RENDERING) &&
-			((parentFlags & OBS_SOURCE_CUSTOM_DRAW) == 0) &&
-			((parentFlags & OBS_SOURCE_ASYNC) == 0);
-
-		const char *techName = "Draw";
-
-		if (canBypass) {
-			gs_technique_t *tech = gs_effect_get_technique(filter->effect, techName);
-			texture = gs_texrender_get_texture(filter->filterTexrender);
-
-			passes = gs_technique_begin(tech);
-			for (i = 0; i < passes; i++) {
-				gs_technique_begin_pass(tech, i);
-				obs_source_video_render(target);
-				gs_technique_end_pass(tech);
-				/*Handle Buffers*/
-				for (j = 0; j < filter->paramList.size(); j++)
-					filter->paramList[j]->onPass(filter, techName, i, texture);
-			}
-			gs_technique_end(tech);
-			for (j = 0; j < filter->paramList.size(); j++)
-				filter->paramList[j]->onTechniqueEnd(filter, techName, texture);
-		} else {
-			texture = gs_texrender_get_texture(filter->filterTexrender);
-			if (texture) {
-				if (filter->image)
-					gs_effect_set_texture(filter->image, texture);
+		texture = gs_texrender_get_texture(filter->filterTexrender);
+		if (texture) {
+			if (filter->image)
+				gs_effect_set_texture(filter->image, texture);
 
-				renderSprite(filter, filter->effect, texture, techName, cx, cy);
-			}
+			renderCachedSprite(filter, filter->drawTechnique, texture, cx, cy);
 		}
+		releaseFilterTarget(filter);
 	} else {
 		obs_source_skip_video_filter(filter->context);
 	}
@@ -2843,6 +3844,7 @@ void ShaderSource::videoRender(void *data, gs_effect_t *effect)
 
 static inline void renderNothing(ShaderSource *filter, const uint32_t &cx, const uint32_t &cy)
 {
+	filter->filterTexrender = renderTargets->acquire(cx, cy);
 	gs_blend_state_push();
 	gs_blend_function(GS_BLEND_ONE, GS_BLEND_ZERO);
 
@@ -2864,6 +3866,7 @@ void ShaderSource::videoRenderSource(void *data, gs_effect_t *effect)
 	UNUSED_PARAMETER(effect);
 	ShaderSource *filter = static_cast<ShaderSource *>(data);
 	size_t        i;
+	ProfileScope  profile(filter->profiler(), PROFILE_RENDER);
 
 	obs_source_t *source;
 	gs_texture_t *texture;
@@ -2883,30 +3886,29 @@ void ShaderSource::videoRenderSource(void *data, gs_effect_t *effect)
 		return;
 
 	if (filter->effect != nullptr) {
-		for (i = 0; i < filter->paramList.size(); i++) {
-			if (filter->paramList[i])
-				filter->paramList[i]->videoRender(filter);
-		}
+		if (renderOutputCache(filter, filter->totalWidth, filter->totalHeight))
+			return;
+
+		for (i = 0; i < filter->renderList.size(); i++)
+			filter->renderList[i]->videoRender(filter);
 
 		renderNothing(filter, cx, cy);
 		texture = gs_texrender_get_texture(filter->filterTexrender);
 		if (texture) {
-			const char *techName = "Draw";
 			if (filter->image)
 				gs_effect_set_texture(filter->image, texture);
-			renderSprite(filter, filter->effect, texture, techName, filter->totalWidth, filter->totalHeight);
+			renderCachedSprite(filter, filter->drawTechnique, texture, filter->totalWidth, filter->totalHeight);
 		}
+		releaseFilterTarget(filter);
 	} else {
 		renderNothing(filter, cx, cy);
 		texture = gs_texrender_get_texture(filter->filterTexrender);
 		if (texture) {
-			const char  *techName = "Draw";
-			gs_effect_t *effect = obs_get_base_effect(OBS_EFFECT_DEFAULT);
-			gs_eparam_t *img = gs_effect_get_param_by_name(effect, "image");
-			if (img)
-				gs_effect_set_texture(img, texture);
-			renderSprite(filter, effect, texture, techName, filter->totalWidth, filter->totalHeight);
+			if (base.image)
+				gs_effect_set_texture(base.image, texture);
+			renderSprite(filter, base.draw, texture, filter->totalWidth, filter->totalHeight);
 		}
+		releaseFilterTarget(filter);
 	}
 }
 
@@ -2923,11 +3925,15 @@ static void renderTransition(void *data, gs_texture_t *a, gs_texture_t *b,
 	size_t i;
 	//uint32_t      parentFlags;
 	gs_texture_t *texture;
+	ProfileScope  profile(filter->profiler(), PROFILE_RENDER);
 
 	uint64_t ts = os_gettime_ns();
 
 	filter->transitionPercentage = t;
 	float seconds = (ts / 1000000000.0);
+	float elapsed = filter->elapsedTime > 0 ? seconds - filter->elapsedTime : 0;
+	filter->advanceExpressionState(elapsed);
+	filter->logExpressionProfile(elapsed);
 	filter->elapsedTimeBinding.d = seconds;
 	filter->elapsedTime = seconds;
 	filter->transitionSeconds = ((filter->startTimestamp - ts) / 1000000000.0);
@@ -2939,10 +3945,8 @@ static void renderTransition(void *data, gs_texture_t *a, gs_texture_t *b,
 	obs_get_video_info(&voi);
 	frame_rate = ((double)voi.fps_num / (double)voi.fps_den);
 
-	for (i = 0; i < filter->paramList.size(); i++) {
-		if (filter->paramList[i])
-			filter->paramList[i]->videoTick(filter, filter->elapsedTime, seconds);
-	}
+	for (i = 0; i < filter->tickList.size(); i++)
+		filter->tickList[i]->videoTick(filter, filter->elapsedTime, seconds);
 
 	int baseWidth = cx;
 	int baseHeight = cy;
@@ -2954,42 +3958,38 @@ static void renderTransition(void *data, gs_texture_t *a, gs_texture_t *b,
 	filter->uvScale.y = (float)filter->totalHeight / baseHeight;
 	filter->uvOffset.x = (float)(-filter->resizeLeft) / baseWidth;
 	filter->uvOffset.y = (float)(-filter->resizeTop) / baseHeight;
-	filter->uvPixelInterval.x = 1.0f / baseWidth;
-	filter->uvPixelInterval.y = 1.0f / baseHeight;
+	filter->uvPixelInterval.x = 1.0f / (baseWidth * renderScaleOf(filter));
+	filter->uvPixelInterval.y = 1.0f / (baseHeight * renderScaleOf(filter));
 
 	filter->uvScaleBinding = filter->uvScale;
 	filter->uvOffsetBinding = filter->uvOffset;
 
 	if (filter->effect != nullptr) {
-		for (i = 0; i < filter->paramList.size(); i++) {
-			if (filter->paramList[i])
-				filter->paramList[i]->videoRender(filter);
-		}
+		for (i = 0; i < filter->renderList.size(); i++)
+			filter->renderList[i]->videoRender(filter);
 
 		renderNothing(filter, cx, cy);
 		texture = gs_texrender_get_texture(filter->filterTexrender);
 		if (a || b) {
-			const char *techName = "Draw";
 			if (filter->image)
 				gs_effect_set_texture(filter->image, a);
 			if (filter->image_1)
 				gs_effect_set_texture(filter->image_1, b);
-			renderSprite(filter, filter->effect, texture, techName, cx, cy);
+			renderScaledSprite(filter, filter->drawTechnique, texture, cx, cy);
 		}
+		releaseFilterTarget(filter);
 	} else {
 		/* Cut Effect */
 		texture = b;
 		if (texture) {
-			const char *techName = "Draw";
-
-			gs_effect_t    *effect = obs_get_base_effect(OBS_EFFECT_DEFAULT);
 			if (!filter->image)
-				filter->image = gs_effect_get_param_by_name(effect, "image");
+				filter->image = base.image;
 
 			gs_effect_set_texture(filter->image, texture);
-			renderSprite(filter, effect, texture, techName, cx, cy);
+			renderSprite(filter, base.draw, texture, cx, cy);
 		} else {
 			renderNothing(filter, cx, cy);
+			releaseFilterTarget(filter);
 		}
 	}
 }
@@ -3017,7 +4017,7 @@ static float mix_a(void *data, float t)
 {
 	ShaderSource *filter = static_cast<ShaderSource *>(data);
 	filter->mixPercent = t;
-	filter->compileExpression(filter->mixAExpression);
+	filter->compileExpression(filter->mixAExpression, &filter->mixAExpression);
 	float vol = 1.0f - t;
 	if (filter->expressionCompiled())
 		vol = filter->evaluateExpression<float>(vol);
@@ -3028,7 +4028,7 @@ static float mix_b(void *data, float t)
 {
 	ShaderSource *filter = static_cast<ShaderSource *>(data);
 	filter->mixPercent = t;
-	filter->compileExpression(filter->mixBExpression);
+	filter->compileExpression(filter->mixBExpression, &filter->mixBExpression);
 	float vol = t;
 	if (filter->expressionCompiled())
 		vol = filter->evaluateExpression<float>(vol);
@@ -3053,12 +4053,103 @@ void ShaderSource::update(void *data, obs_data_t *settings)
 		obs_source_update_properties(filter->context);
 	}
 	size_t i;
-	for (i = 0; i < filter->paramList.size(); i++) {
-		if (filter->paramList[i])
-			filter->paramList[i]->update(filter);
-	}
+	for (i = 0; i < filter->updateList.size(); i++)
+		filter->updateList[i]->update(filter);
 	filter->baseHeight = (int)obs_data_get_int(settings, "size.height");
 	filter->baseWidth = (int)obs_data_get_int(settings, "size.width");
+	filter->_profileExpressions = obs_data_get_bool(settings, "profile_expressions");
+	/* Older versions kept the summaries in the settings */
+	obs_data_erase(settings, "expression_profile");
+	obs_data_erase(settings, "render_profile");
+	bool profileRender = obs_data_get_bool(settings, "profile_render");
+	if (profileRender && !filter->_profileRender)
+		filter->renderProfile.reset();
+	filter->_profileRender = profileRender;
+	{
+		std::lock_guard<std::mutex> lock(filter->_profileMutex);
+		filter->_profileCsvPath = obs_data_get_string(settings, "profile_csv");
+	}
+	filter->renderScale = (float)hlsl_clamp(obs_data_get_double(settings, "render_scale"), 0.05, 1.0);
+	filter->upsampleEdge = strcmp(obs_data_get_string(settings, "render_upsample"), "Edge") == 0;
+	filter->updateRate = (float)hlsl_clamp(obs_data_get_double(settings, "update_rate"), 0.0, 60.0);
+	filter->updateInterpolate = obs_data_get_bool(settings, "update_interpolate");
+	/*Settings changes show on the next frame*/
+	filter->_outputDirty = true;
+	if (filter->updateRate <= 0.0f && filter->_outputCount) {
+		obs_enter_graphics();
+		filter->destroyOutputCache();
+		obs_leave_graphics();
+	}
+}
+
+static bool shader_filter_refresh_profile_clicked(obs_properties_t *props, obs_property_t *property, void *data)
+{
+	UNUSED_PARAMETER(property);
+	ShaderSource *filter = static_cast<ShaderSource *>(data);
+	obs_property_set_description(obs_properties_get(props, "expression_profile"),
+		filter->publishedExpressionProfile().c_str());
+	return true;
+}
+
+static bool shader_filter_refresh_render_profile_clicked(
+		obs_properties_t *props, obs_property_t *property, void *data)
+{
+	UNUSED_PARAMETER(property);
+	ShaderSource *filter = static_cast<ShaderSource *>(data);
+	obs_property_set_description(obs_properties_get(props, "render_profile"),
+		filter->renderProfileSummary().c_str());
+	return true;
+}
+
+static bool shader_filter_reset_render_profile_clicked(
+		obs_properties_t *props, obs_property_t *property, void *data)
+{
+	UNUSED_PARAMETER(property);
+	ShaderSource *filter = static_cast<ShaderSource *>(data);
+	filter->renderProfile.reset();
+	obs_property_set_description(obs_properties_get(props, "render_profile"),
+		filter->renderProfileSummary().c_str());
+	return true;
+}
+
+static void addRenderScaleProperties(obs_properties_t *props)
+{
+	obs_properties_add_float_slider(props, "render_scale", obs_module_text("RenderScale"), 0.05, 1.0, 0.05);
+	obs_property_t *p = obs_properties_add_list(props, "render_upsample", obs_module_text("Upsample"),
+		OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_STRING);
+	obs_property_list_add_string(p, obs_module_text("Upsample.Bilinear"), "Bilinear");
+	obs_property_list_add_string(p, obs_module_text("Upsample.Edge"), "Edge");
+	p = obs_properties_add_float_slider(props, "update_rate", obs_module_text("UpdateRate"), 0.0, 60.0, 1.0);
+	obs_property_set_long_description(p, obs_module_text("UpdateRate.Description"));
+	obs_properties_add_bool(props, "update_interpolate", obs_module_text("UpdateInterpolate"));
+}
+
+static void addProfileProperties(ShaderSource *filter, obs_properties_t *props)
+{
+	obs_properties_t *group = obs_properties_create();
+
+	/* Info text shows its description and is never stored in the settings */
+	obs_property_t *p = obs_properties_add_text(
+		group, "expression_profile", filter->publishedExpressionProfile().c_str(), OBS_TEXT_INFO);
+	obs_property_set_long_description(p, obs_module_text("ExpressionProfile"));
+	obs_properties_add_button(group, "refresh_profile", obs_module_text("Refresh"),
+		shader_filter_refresh_profile_clicked);
+
+	obs_properties_add_group(props, "profile_expressions", obs_module_text("ProfileExpressions"),
+		OBS_GROUP_CHECKABLE, group);
+
+	group = obs_properties_create();
+	p = obs_properties_add_text(group, "render_profile", filter->renderProfileSummary().c_str(), OBS_TEXT_INFO);
+	obs_property_set_long_description(p, obs_module_text("RenderProfile"));
+	obs_properties_add_button(group, "refresh_render_profile", obs_module_text("Refresh"),
+		shader_filter_refresh_render_profile_clicked);
+	obs_properties_add_button(group, "reset_render_profile", obs_module_text("Reset"),
+		shader_filter_reset_render_profile_clicked);
+	obs_properties_add_path(group, "profile_csv", obs_module_text("ProfileCsv"), OBS_PATH_FILE_SAVE,
+		"CSV (*.csv)", NULL);
+
+	obs_properties_add_group(props, "profile_render", obs_module_text("ProfileRender"),
+		OBS_GROUP_CHECKABLE, group);
 }
 
 obs_properties_t *ShaderSource::getProperties(void *data)
@@ -3087,6 +4178,9 @@ obs_properties_t *ShaderSource::getProperties(void *data)
 		if (filter->paramList[i])
 			filter->paramList[i]->getProperties(filter, props);
 	}
+
+	addRenderScaleProperties(props);
+	addProfileProperties(filter, props);
 	return props;
 }
 
@@ -3119,6 +4213,9 @@ obs_properties_t *ShaderSource::getPropertiesSource(void *data)
 		if (filter->paramList[i])
 			filter->paramList[i]->getProperties(filter, props);
 	}
+
+	addRenderScaleProperties(props);
+	addProfileProperties(filter, props);
 	return props;
 }
 
@@ -3323,6 +4420,11 @@ bool loadModuleEffect(gs_effect_t **effect, std::string name)
 bool obs_module_load(void)
 {
 	screenMutex = new PThreadMutex();
+	particlePool = new ParticleThreadPool(std::thread::hardware_concurrency());
+	particleSimulation = new ParticleSimulation(particlePool);
+	renderTargets = new RenderTargetPool();
+	sourceRenders = new SourceRenderCache();
+	profileWriter = os_task_queue_create();
 	struct obs_source_info shader_filter = { 0 };
 	shader_filter.id = "obs_shader_filter";
 	shader_filter.type = OBS_SOURCE_TYPE_FILTER;
@@ -3388,6 +4490,30 @@ bool obs_module_load(void)
 
 	if (!loadModuleEffect(&default_effect, "default.effect"))
 		return false;
+	if (!loadModuleEffect(&particle_effect, "particle.effect"))
+		return false;
+	if (!loadModuleEffect(&upsample_effect, "upsample.effect"))
+		return false;
+
+	particle.draw = gs_effect_get_technique(particle_effect, "Draw");
+	particle.clear = gs_effect_get_technique(particle_effect, "Clear");
+	particle.image = gs_effect_get_param_by_name(particle_effect, "image");
+	particle.instances = gs_effect_get_param_by_name(particle_effect, "instances");
+	particle.atlasSize = gs_effect_get_param_by_name(particle_effect, "atlas_size");
+	particle.atlasFps = gs_effect_get_param_by_name(particle_effect, "atlas_fps");
+
+	upsample.bilinear = gs_effect_get_technique(upsample_effect, "Bilinear");
+	upsample.edge = gs_effect_get_technique(upsample_effect, "Edge");
+	upsample.interpolate = gs_effect_get_technique(upsample_effect, "Interpolate");
+	upsample.image = gs_effect_get_param_by_name(upsample_effect, "image");
+	upsample.guide = gs_effect_get_param_by_name(upsample_effect, "guide");
+	upsample.lowSize = gs_effect_get_param_by_name(upsample_effect, "low_size");
+	upsample.previous = gs_effect_get_param_by_name(upsample_effect, "previous");
+	upsample.interpolation = gs_effect_get_param_by_name(upsample_effect, "interpolation");
+
+	gs_effect_t *baseEffect = obs_get_base_effect(OBS_EFFECT_DEFAULT);
+	base.draw = gs_effect_get_technique(baseEffect, "Draw");
+	base.image = gs_effect_get_param_by_name(baseEffect, "image");
 
 	return true;
 }
@@ -3398,7 +4524,28 @@ void obs_module_unload(void)
 
 	if (default_effect)
 		gs_effect_destroy(default_effect);
+	if (particle_effect)
+		gs_effect_destroy(particle_effect);
+	if (upsample_effect)
+		gs_effect_destroy(upsample_effect);
+	if (particleIndexBuffer)
+		gs_indexbuffer_destroy(particleIndexBuffer);
+	if (particleQuadBuffer)
+		gs_vertexbuffer_destroy(particleQuadBuffer);
+	particleIndexBuffer = nullptr;
+	particleQuadBuffer = nullptr;
+	particleQuadCapacity = 0;
+
+	delete renderTargets;
+	renderTargets = nullptr;
+	delete sourceRenders;
+	sourceRenders = nullptr;
 
 	obs_leave_graphics();
+	/* Waits for the rows still queued */
+	os_task_queue_destroy(profileWriter);
+	profileWriter = nullptr;
+	delete particleSimulation;
+	delete particlePool;
 	delete screenMutex;
 }
@@ -16,8 +16,14 @@ extern "C" {
 #include <util/circlebuf.h>
 #include <util/dstr.h>
 #include <util/platform.h>
+#include <util/task.h>
 #include <util/threading.h>
 
+/* Profiling uses GPU timer queries, OBS_TEXT_INFO and os_task_queue */
+#if LIBOBS_API_MAJOR_VER < 27
+#error "obs-shader-filter requires libobs 27 or newer"
+#endif
+
 #include <float.h>
 #include <limits.h>
 #include <stdio.h>
@@ -26,11 +32,16 @@ extern "C" {
 #include <unordered_map>
 #include <vector>
 #include <list>
+#include <atomic>
+#include <mutex>
+#include <memory>
 #include <algorithm>
 
 #include "fft.h"
 #include "tinyexpr.h"
+#include "expression-cache.hpp"
 #include "mtrandom.h"
+#include "particles.hpp"
 
 #undef _ENABLE_EXTENDED_ALIGNED_STORAGE
 
@@ -109,13 +120,136 @@ struct bind2 {
 	}
 };
 
+struct expression_stats {
+	uint64_t calls = 0;
+	uint64_t samples = 0;
+	uint64_t sampledNs = 0;
+	int      nodes = 0;
+
+	uint64_t estimatedNs() const
+	{
+		return samples ? (uint64_t)((double)sampledNs * calls / samples) : 0;
+	}
+};
+
+/* Phases of a filter's frame timed on the CPU, nested phases are also counted in
+ * the phase around them (expressions, audio and particles run inside tick or render) */
+enum profile_phase {
+	PROFILE_TICK,
+	PROFILE_RENDER,
+	PROFILE_EXPRESSIONS,
+	PROFILE_AUDIO,
+	PROFILE_PARTICLES,
+	PROFILE_PHASES
+};
+
+#define PROFILE_MAX_PASSES 8
+/* Frames a GPU timer query gets before its result is read */
+#define PROFILE_TIMER_LATENCY 4
+
+/* Running totals written by the video thread and read by the properties panel,
+ * relaxed atomics are enough for statistics so neither side ever locks */
+struct render_profile {
+	std::atomic<uint64_t> calls[PROFILE_PHASES];
+	std::atomic<uint64_t> ns[PROFILE_PHASES];
+	std::atomic<uint64_t> gpuCalls[PROFILE_MAX_PASSES];
+	std::atomic<uint64_t> gpuNs[PROFILE_MAX_PASSES];
+
+	render_profile()
+	{
+		reset();
+	}
+
+	void reset()
+	{
+		for (size_t i = 0; i < PROFILE_PHASES; i++) {
+			calls[i].store(0, std::memory_order_relaxed);
+			ns[i].store(0, std::memory_order_relaxed);
+		}
+		for (size_t i = 0; i < PROFILE_MAX_PASSES; i++) {
+			gpuCalls[i].store(0, std::memory_order_relaxed);
+			gpuNs[i].store(0, std::memory_order_relaxed);
+		}
+	}
+
+	void add(profile_phase phase, uint64_t elapsed)
+	{
+		calls[phase].fetch_add(1, std::memory_order_relaxed);
+		ns[phase].fetch_add(elapsed, std::memory_order_relaxed);
+	}
+
+	void addGpu(size_t pass, uint64_t elapsed)
+	{
+		if (pass >= PROFILE_MAX_PASSES)
+			return;
+		gpuCalls[pass].fetch_add(1, std::memory_order_relaxed);
+		gpuNs[pass].fetch_add(elapsed, std::memory_order_relaxed);
+	}
+};
+
+/* Times its scope into profile, does nothing when profile is null */
+class ProfileScope {
+	render_profile *_profile;
+	profile_phase   _phase;
+	uint64_t        _start;
+
+public:
+	ProfileScope(render_profile *profile, profile_phase phase)
+		: _profile(profile), _phase(phase), _start(profile ? os_gettime_ns() : 0)
+	{
+	}
+	~ProfileScope()
+	{
+		if (_profile)
+			_profile->add(_phase, os_gettime_ns() - _start);
+	}
+};
+
+/* GPU timer queries of one pass, results are read PROFILE_TIMER_LATENCY frames
+ * later so the CPU never waits on the GPU */
+struct gpu_pass_timer {
+	gs_timer_range_t *range[PROFILE_TIMER_LATENCY] = {};
+	gs_timer_t       *timer[PROFILE_TIMER_LATENCY] = {};
+	bool              pending[PROFILE_TIMER_LATENCY] = {};
+	size_t            next = 0;
+};
+
 class TinyExpr : public std::vector<te_variable> {
 	std::string _expr;
 	te_expr    *_compiled = nullptr;
 	int         _err = 0;
 	std::string _errString = "";
 
-	std::unordered_map<std::string, te_expr*> _compiledMap;
+	te_vector  *_compiledVector = nullptr;
+
+	/* Profiling times one in every _sampleInterval evaluations */
+	bool              _profile = false;
+	uint64_t          _sampleInterval = 16;
+	expression_stats *_stats = nullptr;
+	expression_stats *_vectorStats = nullptr;
+	std::unordered_map<std::string, expression_stats> _statsMap;
+
+	expression_stats *trackStats(const std::string &expression, bool compiled)
+	{
+		if (!_profile || !compiled)
+			return nullptr;
+		return &_statsMap[expression];
+	}
+
+	template<class Eval> void sample(expression_stats *stats, Eval eval)
+	{
+		if (stats->calls++ % _sampleInterval) {
+			eval();
+			return;
+		}
+		uint64_t start = os_gettime_ns();
+		eval();
+		stats->sampledNs += os_gettime_ns() - start;
+		stats->samples++;
+	}
+
+	expression_cache<te_expr>   _compiledMap{te_free};
+	expression_cache<te_vector> _compiledVectorMap{te_free_vector};
 	std::unordered_map<std::string, int> _errMap;
 	std::unordered_map<std::string, std::string> _errStrMap;
 public:
@@ -128,15 +262,41 @@ public:
 	}
 	void releaseExpression()
 	{
-		for (auto it : _compiledMap) {
-			te_free(it.second);
-			it.second = nullptr;
-		}
 		_compiledMap.clear();
+		_compiledVectorMap.clear();
+		_compiled = nullptr;
+		_compiledVector = nullptr;
+		_stats = nullptr;
+		_vectorStats = nullptr;
+		_statsMap.clear();
 		_errMap.clear();
 		_errStrMap.clear();
 	}
 
+	void setProfiling(bool profile)
+	{
+		if (_profile == profile)
+			return;
+		_profile = profile;
+		_stats = nullptr;
+		_vectorStats = nullptr;
+		_statsMap.clear();
+	}
+	bool profiling()
+	{
+		return _profile;
+	}
+	/* Most expensive expressions first */
+	std::vector<std::pair<std::string, expression_stats>> profile()
+	{
+		std::vector<std::pair<std::string, expression_stats>> ret(_statsMap.begin(), _statsMap.end());
+		std::sort(ret.begin(), ret.end(), [](const std::pair<std::string, expression_stats> &a,
+				const std::pair<std::string, expression_stats> &b) {
+			return a.second.estimatedNs() > b.second.estimatedNs();
+		});
+		return ret;
+	}
+
 	bool hasVariable(std::string search)
 	{
 		if (!size())
@@ -150,29 +310,37 @@ public:
 	template<class DataType> DataType evaluate(DataType default_value = 0)
 	{
 		DataType ret = default_value;
-		if (_compiled)
+		if (_compiled && _stats)
+			sample(_stats, [&]() { ret = (DataType)te_eval(_compiled); });
+		else if (_compiled)
 			ret = (DataType)te_eval(_compiled);
 		return ret;
 	}
-	template<class DataType> DataType evaluate(std::string expression, DataType default_value = 0)
+	template<class DataType> DataType evaluate(std::string expression, DataType default_value = 0,
+			const void *owner = nullptr)
 	{
 		DataType ret = default_value;
-		if (_compiledMap.count(expression))
-			ret = (DataType)te_eval(_compiledMap.at(expression));
+		te_expr *compiled = nullptr;
+		if (_compiledMap.find(expression, owner, compiled) && compiled)
+			ret = (DataType)te_eval(compiled);
 		return ret;
 	}
-	void compile(std::string expression)
+	/* Stateful expressions are compiled once per owner, pure ones are shared by text */
+	void compile(std::string expression, const void *owner = nullptr)
 	{
 		if (expression.empty())
 			return;
-		if (_compiledMap.count(expression)) {
-			_compiled = _compiledMap.at(expression);
+		if (_compiledMap.find(expression, owner, _compiled)) {
 			_errString = _errStrMap.at(expression);
 			_err = _errMap.at(expression);
+			_stats = trackStats(expression, _compiled != nullptr);
+			if (_stats && !_stats->nodes)
+				_stats->nodes = te_node_count(_compiled);
 			return;
 		}
 
 		_compiled = te_compile(expression.c_str(), data(), (int)size(), &_err);
+		_stats = trackStats(expression, _compiled != nullptr);
 		if (!_compiled) {
 			_errString = "Expression Error At [" + std::to_string(_err) + "] in: " + expression + "\n" +
 				expression.substr(0, _err) + "[ERROR HERE]" + expression.substr(_err);
@@ -184,7 +352,55 @@ public:
 
 		_errStrMap[expression] = _errString;
 		_errMap[expression] = _err;
-		_compiledMap[expression] = _compiled;
+		_compiledMap.insert(expression, owner, _compiled, te_is_stateful(_compiled) != 0);
+		if (_stats)
+			_stats->nodes = te_node_count(_compiled);
+	}
+	/* Evaluates every component of the last compiled vector, returns the count written */
+	size_t evaluateVector(double *out, size_t count)
+	{
+		if (!_compiledVector)
+			return 0;
+		size_t ret = 0;
+		if (_vectorStats)
+			sample(_vectorStats, [&]() { ret = (size_t)te_eval_vector(_compiledVector, out, (int)count); });
+		else
+			ret = (size_t)te_eval_vector(_compiledVector, out, (int)count);
+		return ret;
+	}
+	void compileVector(std::string expression, const void *owner = nullptr)
+	{
+		if (expression.empty())
+			return;
+		if (_compiledVectorMap.find(expression, owner, _compiledVector)) {
+			_errString = _errStrMap.at(expression);
+			_err = _errMap.at(expression);
+			_vectorStats = trackStats(expression, _compiledVector != nullptr);
+			if (_vectorStats && !_vectorStats->nodes)
+				_vectorStats->nodes = te_vector_node_count(_compiledVector);
+			return;
+		}
+
+		_compiledVector = te_compile_vector(expression.c_str(), data(), (int)size(), &_err);
+		_vectorStats = trackStats(expression, _compiledVector != nullptr);
+		if (!_compiledVector) {
+			_errString = "Expression Error At [" + std::to_string(_err) + "] in: " + expression + "\n" +
+				expression.substr(0, _err) + "[ERROR HERE]" + expression.substr(_err);
+			blog(LOG_WARNING, _errString.c_str());
+		} else {
+			_errString = "";
+			_expr = expression;
+		}
+
+		_errStrMap[expression] = _errString;
+		_errMap[expression] = _err;
+		_compiledVectorMap.insert(expression, owner, _compiledVector, te_vector_is_stateful(_compiledVector) != 0);
+		if (_vectorStats)
+			_vectorStats->nodes = te_vector_node_count(_compiledVector);
+	}
+	bool vectorSuccess()
+	{
+		return _compiledVector != nullptr;
 	}
 	bool success()
 	{
@@ -200,6 +416,81 @@ public:
 	}
 };
 
+class ExpressionState;
+
+/* Per call site state of a stateful expression function */
+struct expression_slot {
+	ExpressionState *state;
+	uint64_t         frame;
+	double           value;
+	double           last;
+};
+
+#define EXPRESSION_DELAY_FRAMES 64
+
+struct expression_delay_slot {
+	expression_slot slot;
+	size_t          head;
+	double          history[EXPRESSION_DELAY_FRAMES];
+};
+
+/* Arena backing prev/smooth/integrate/delay, slots live until the next reset */
+class ExpressionState {
+	static const size_t blockSize = 4096;
+
+	std::vector<uint8_t *> _blocks;
+	size_t                 _used = blockSize;
+
+	static void *allocate(void *arena, size_t size)
+	{
+		ExpressionState *state = static_cast<ExpressionState *>(arena);
+		size = (size + 7) & ~(size_t)7;
+		if (state->_used + size > blockSize) {
+			state->_blocks.push_back((uint8_t *)bzalloc(std::max(size, blockSize)));
+			state->_used = 0;
+		}
+		expression_slot *slot = (expression_slot *)(state->_blocks.back() + state->_used);
+		state->_used += size;
+
+		memset(slot, 0, size);
+		slot->state = state;
+		slot->frame = UINT64_MAX;
+		return slot;
+	}
+
+public:
+	uint64_t frame = 0;
+	double   seconds = 0;
+
+	te_state_allocator slotAllocator = { allocate, this, sizeof(expression_slot) };
+	te_state_allocator delayAllocator = { allocate, this, sizeof(expression_delay_slot) };
+
+	ExpressionState()
+	{
+	}
+	ExpressionState(const ExpressionState &) = delete;
+	ExpressionState &operator=(const ExpressionState &) = delete;
+	~ExpressionState()
+	{
+		reset();
+	}
+
+	void advance(double elapsed)
+	{
+		frame++;
+		seconds = elapsed;
+	}
+
+	/* Only call once every expression holding a slot has been released */
+	void reset()
+	{
+		for (uint8_t *block : _blocks)
+			bfree(block);
+		_blocks.clear();
+		_used = blockSize;
+	}
+};
+
 class PThreadMutex {
 	bool            _mutexCreated;
 	pthread_mutex_t _mutex;
@@ -244,11 +535,79 @@ public:
 	}
 };
 
+/* Texrenders shared by every ShaderSource, only touched on the graphics thread.
+ * acquire hands out a free target of the given size and format, release returns
+ * it once its texture was drawn from. Targets still held from an earlier frame
+ * are reclaimed, and targets unused for a while are destroyed. */
+class RenderTargetPool {
+	struct entry {
+		gs_texrender_t *texrender;
+		uint32_t        width;
+		uint32_t        height;
+		gs_color_format format;
+		bool            used;
+		uint64_t        frame;
+	};
+	std::vector<entry> _entries;
+
+public:
+	~RenderTargetPool();
+
+	gs_texrender_t *acquire(uint32_t width, uint32_t height, gs_color_format format = GS_RGBA);
+	void            release(gs_texrender_t *texrender);
+	size_t          size() const
+	{
+		return _entries.size();
+	}
+};
+
+/* Renders of the sources textures reference, shared by every consumer on the
+ * graphics thread. A source is rendered at most once per frame for each size it
+ * is drawn at. Unfiltered still images and paused, stopped or ended media keep
+ * their render until their settings, size, media state or media time change. */
+class SourceRenderCache {
+	struct entry {
+		obs_weak_source_t   *source = nullptr;
+		uint32_t             cx = 0;
+		uint32_t             cy = 0;
+		gs_texrender_t      *texrender = nullptr;
+		uint64_t             frame = 0;
+		uint32_t             width = 0;
+		uint32_t             height = 0;
+		/* When the source last started showing the same picture, 0 while it may change */
+		uint64_t             staticSince = 0;
+		enum obs_media_state mediaState = OBS_MEDIA_STATE_NONE;
+		int64_t              mediaTime = 0;
+		/* Bumped by the source's update signal, which may come from any thread */
+		std::atomic<uint64_t> updates{ 0 };
+		uint64_t              renderedUpdates = 0;
+	};
+	/* Entries stay put while a render recurses into the cache */
+	std::vector<std::unique_ptr<entry>> _entries;
+
+	static void sourceUpdated(void *data, calldata_t *cd);
+	void        release(entry *e);
+
+public:
+	~SourceRenderCache();
+
+	/* The source drawn scaled to cx by cy into a target of its own size */
+	gs_texture_t *render(obs_source_t *source, uint32_t cx, uint32_t cy);
+};
+
 class EVal;
 class EParam;
 class ShaderSource;
 class ShaderData;
 
+/* Hooks a parameter's data implements, each phase is only dispatched to its subscribers */
+enum param_phase {
+	PARAM_TICK = 1 << 0,
+	PARAM_RENDER = 1 << 1,
+	PARAM_UPDATE = 1 << 2,
+	PARAM_PASS = 1 << 3
+};
+
 class ShaderParameter {
 protected:
 	EParam     *_param = nullptr;
@@ -280,8 +639,11 @@ public:
 	void videoRender(ShaderSource *filter);
 	void update(ShaderSource *filter);
 	void getProperties(ShaderSource *filter, obs_properties_t *props);
-	void onPass(ShaderSource *filter, const char *technique, size_t pass, gs_texture_t *texture);
-	void onTechniqueEnd(ShaderSource *filter, const char *technique, gs_texture_t *texture);
+	void onPass(ShaderSource *filter, gs_technique_t *technique, size_t pass, gs_texture_t *texture);
+	void onTechniqueEnd(ShaderSource *filter, gs_technique_t *technique, gs_texture_t *texture);
+	bool beginPass(ShaderSource *filter, gs_technique_t *technique, size_t pass, uint32_t cx, uint32_t cy);
+	void endPass(ShaderSource *filter);
+	uint32_t phases();
 };
 
 class ShaderSource {
@@ -294,7 +656,16 @@ protected:
 	PThreadMutex *_mutex = nullptr;
 	bool          _reloadEffect = true;
 
-	TinyExpr expression;
+	TinyExpr        expression;
+	ExpressionState _expressionState;
+
+	/* Expression statistics belong to the video thread, which applies the
+	   requested profiling state and publishes a summary for the properties */
+	std::atomic<bool> _profileExpressions{ false };
+	float             _profileLogTime = 0;
+	float             _profilePublishTime = 0;
+	std::mutex        _profileMutex;
+	std::string       _expressionProfileText;
 
 	obs_source_type _source_type;
 public:
@@ -311,7 +682,25 @@ public:
 	uint32_t totalHeight;
 
 	gs_effect_t *effect = nullptr;
+	/* The effect's Draw technique, resolved on reload */
+	gs_technique_t *drawTechnique = nullptr;
 	gs_texrender_t *filterTexrender = nullptr;
+	/* Set on reload when the effect can draw the filter target directly,
+	   parameters that need the rendered target clear it */
+	bool directRender = false;
+	/* Fraction of the output resolution the effect renders at, smaller outputs are
+	   upsampled bilinearly or with upsample.effect's edge aware technique */
+	float renderScale = 1.0f;
+	bool  upsampleEdge = false;
+	/* Effects updating at most updateRate times a second draw their last output in
+	   between, optionally blending from the previous output towards the last one */
+	float           updateRate = 0.0f;
+	bool            updateInterpolate = false;
+	gs_texrender_t *_outputCache[2] = {};
+	size_t          _outputFront = 0;
+	size_t          _outputCount = 0;
+	float           _outputAge = 0.0f;
+	bool            _outputDirty = true;
 
 	double _clickCount;
 	double _mouseUp;
@@ -330,6 +719,9 @@ public:
 	double _mouseWheelDeltaX;
 	double _mouseWheelDeltaY;
 
+	particleQuery      _particleQuery = { nullptr, 0, 0, nullptr };
+	te_state_allocator _neighborsBinding = {};
+
 	std::vector<double> _screenWidth;
 	std::vector<double> _screenHeight;
 
@@ -343,6 +735,11 @@ public:
 	std::vector<ShaderParameter *>                     paramList = {};
 	std::unordered_map<std::string, ShaderParameter *> paramMap;
 	std::vector<ShaderParameter *>                     evaluationList = {};
+	/* paramList split by the phases each parameter subscribes to */
+	std::vector<ShaderParameter *>                     tickList = {};
+	std::vector<ShaderParameter *>                     renderList = {};
+	std::vector<ShaderParameter *>                     updateList = {};
+	std::vector<ShaderParameter *>                     passList = {};
 
 	std::string resizeExpressions[4];
 	int         resizeLeft = 0;
@@ -383,15 +780,41 @@ public:
 	bool                           needsReloading();
 	std::vector<ShaderParameter *> parameters();
 	void                           clearExpression();
+	void                           advanceExpressionState(double seconds);
+	ExpressionState               *getExpressionState();
 	void                           appendVariable(te_variable var);
 	void                           appendVariable(std::string &name, double *binding);
 
-	void compileExpression(std::string expr = "");
+	void compileExpression(std::string expr = "", const void *owner = nullptr);
 
 	template<class DataType> DataType evaluateExpression(DataType default_value = 0);
 	bool                              expressionCompiled();
+	std::string                       expressionProfile();
+	std::string                       publishedExpressionProfile();
+	void                              logExpressionProfile(float seconds);
+
+	void   compileVectorExpression(std::string expr = "", const void *owner = nullptr);
+	size_t evaluateVectorExpression(double *out, size_t count);
+	bool   vectorExpressionCompiled();
 	std::string                       expressionError();
 
+	/* CPU and GPU timing shown in the properties, null while profiling is off */
+	render_profile              renderProfile;
+	std::atomic<bool>           _profileRender{ false };
+	std::string                 _profileCsvPath;
+	float                       _profileCsvTime = 0;
+	std::vector<gpu_pass_timer> _passTimers;
+	render_profile             *profiler()
+	{
+		return _profileRender ? &renderProfile : nullptr;
+	}
+	std::string renderProfileSummary();
+	void        writeRenderProfile(float seconds);
+	void        beginPassTimer(size_t pass);
+	void        endPassTimer(size_t pass);
+	void        destroyPassTimers();
+	void        destroyOutputCache();
+
 	ShaderSource(obs_data_t *settings, obs_source_t *source);
 	~ShaderSource();
 
@@ -0,0 +1,622 @@
+#include "particles.hpp"
+
+#include <float.h>
+#include <math.h>
+#include <string.h>
+#include <functional>
+#include <algorithm>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#define PARTICLES_SSE 1
+#include <emmintrin.h>
+#endif
+
+void particleStorage::setCapacity(size_t capacity)
+{
+	for (size_t k = 0; k < PARTICLE_AFFINE_SIZE; k++) {
+		position[k].assign(capacity, 0.0f);
+		transform[k].assign(capacity, 0.0f);
+	}
+	z.assign(capacity, 0.0f);
+	decayAlpha.assign(capacity, 0.0f);
+	alpha.assign(capacity, 0.0f);
+	lifeTime.assign(capacity, 0.0f);
+	localLifeTime.assign(capacity, 0.0f);
+	frame.assign(capacity, 0.0f);
+	count = 0;
+}
+
+size_t particleStorage::spawn(float a, float decay, float life, float localLife)
+{
+	if (count >= capacity())
+		return SIZE_MAX;
+	size_t i = count++;
+	decayAlpha[i] = decay;
+	alpha[i] = a;
+	lifeTime[i] = life;
+	localLifeTime[i] = localLife;
+	frame[i] = 0;
+	return i;
+}
+
+void particleStorage::move(size_t dst, size_t src)
+{
+	if (dst == src)
+		return;
+	for (size_t k = 0; k < PARTICLE_AFFINE_SIZE; k++) {
+		position[k][dst] = position[k][src];
+		transform[k][dst] = transform[k][src];
+	}
+	z[dst] = z[src];
+	decayAlpha[dst] = decayAlpha[src];
+	alpha[dst] = alpha[src];
+	lifeTime[dst] = lifeTime[src];
+	localLifeTime[dst] = localLifeTime[src];
+	frame[dst] = frame[src];
+}
+
+void particleStorage::removeWhere(uint8_t *flags, uint8_t value, uint8_t *carried, size_t begin)
+{
+	/* Walking down, whatever is swapped in from the end was already checked */
+	for (size_t i = count; i-- > begin;) {
+		if (flags[i] != value)
+			continue;
+		flags[i] = flags[count - 1];
+		if (carried)
+			carried[i] = carried[count - 1];
+		remove(i);
+	}
+}
+
+void particleStorage::removeOldest(size_t victims, std::vector<uint32_t> &scratch, uint8_t *carried)
+{
+	victims = std::min(victims, count);
+	if (victims == 0)
+		return;
+	const float *life = lifeTime.data();
+	scratch.resize(count);
+	for (size_t i = 0; i < count; i++)
+		scratch[i] = (uint32_t)i;
+	auto older = [life](uint32_t a, uint32_t b) {
+		return life[a] > life[b];
+	};
+	if (victims < count)
+		std::nth_element(scratch.begin(), scratch.begin() + (victims - 1), scratch.end(), older);
+	/* Remove from the highest slot down so swapped in particles are never victims */
+	std::sort(scratch.begin(), scratch.begin() + victims, std::greater<uint32_t>());
+	for (size_t i = 0; i < victims; i++) {
+		if (carried)
+			carried[scratch[i]] = carried[count - 1];
+		remove(scratch[i]);
+	}
+}
+
+void particle_affine_compose(float *out, float x, float y, float z, float ax, float ay, float az, float angle)
+{
+	float sine = sinf(angle * 0.5f);
+	float qx = ax * sine;
+	float qy = ay * sine;
+	float qz = az * sine;
+	float qw = cosf(angle * 0.5f);
+	float norm = qx * qx + qy * qy + qz * qz + qw * qw;
+	float s = norm > 0.0f ? 2.0f / norm : 0.0f;
+
+	float xx = qx * qx * s, yy = qy * qy * s, zz = qz * qz * s;
+	float xy = qx * qy * s, xz = qx * qz * s, yz = qy * qz * s;
+	float wx = qw * qx * s, wy = qw * qy * s, wz = qw * qz * s;
+
+	float *r = out;
+	r[0] = 1.0f - (yy + zz); r[1] = xy + wz;          r[2] = xz - wy;
+	r[3] = xy - wz;          r[4] = 1.0f - (xx + zz); r[5] = yz + wx;
+	r[6] = xz + wy;          r[7] = yz - wx;          r[8] = 1.0f - (xx + yy);
+	/* Translation is applied first, so it is rotated too */
+	for (int c = 0; c < 3; c++)
+		out[9 + c] = x * r[c] + y * r[3 + c] + z * r[6 + c];
+}
+
+void particle_age(particleStorage &particles, size_t begin, size_t end, float seconds, float rate,
+		uint8_t *expired)
+{
+	float *lifeTime = particles.lifeTime.data();
+	float *alpha = particles.alpha.data();
+	const float *decayAlpha = particles.decayAlpha.data();
+	const float *localLifeTime = particles.localLifeTime.data();
+	for (size_t i = begin; i < end; i++) {
+		lifeTime[i] += seconds;
+		alpha[i] = std::min(std::max(alpha[i] - decayAlpha[i] * rate, 0.0f), 255.0f);
+	}
+	if (expired) {
+		for (size_t i = begin; i < end; i++)
+			expired[i] = localLifeTime[i] < lifeTime[i];
+	}
+}
+
+/* Unit quad corners in order (-,-), (+,-), (-,+), (+,+) */
+static const float cornerSign[4][2] = { {-0.5f, -0.5f}, {0.5f, -0.5f}, {-0.5f, 0.5f}, {0.5f, 0.5f} };
+
+static void integrate_scalar(float **p, float *const *m, float *z, const float *alpha,
+		uint8_t *visible, size_t begin, size_t end)
+{
+	for (size_t i = begin; i < end; i++) {
+		float l[PARTICLE_AFFINE_SIZE];
+		/* L' = L * M, t' = t * M + u */
+		for (int r = 0; r < 4; r++) {
+			for (int c = 0; c < 3; c++) {
+				float s = p[r * 3][i] * m[c][i] + p[r * 3 + 1][i] * m[3 + c][i] +
+						p[r * 3 + 2][i] * m[6 + c][i];
+				l[r * 3 + c] = r == 3 ? s + m[9 + c][i] : s;
+			}
+		}
+		for (int k = 0; k < PARTICLE_AFFINE_SIZE; k++)
+			p[k][i] = l[k];
+		z[i] = l[11];
+
+		bool in_view = false;
+		for (int j = 0; j < 4; j++) {
+			float x = l[9] + cornerSign[j][0] * l[0] + cornerSign[j][1] * l[3];
+			float y = l[10] + cornerSign[j][0] * l[1] + cornerSign[j][1] * l[4];
+			in_view = in_view || (fabsf(x) <= 1.0f && fabsf(y) <= 1.0f);
+		}
+		visible[i] = alpha[i] > 0 && in_view;
+	}
+}
+
+#ifdef PARTICLES_SSE
+static size_t integrate_sse(float **p, float *const *m, float *z, const float *alpha,
+		uint8_t *visible, size_t begin, size_t end)
+{
+	const __m128 half = _mm_set1_ps(0.5f);
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+
+	size_t i = begin;
+	for (; i + 4 <= end; i += 4) {
+		__m128 mv[PARTICLE_AFFINE_SIZE];
+		__m128 pv[PARTICLE_AFFINE_SIZE];
+		for (int k = 0; k < PARTICLE_AFFINE_SIZE; k++) {
+			mv[k] = _mm_loadu_ps(m[k] + i);
+			pv[k] = _mm_loadu_ps(p[k] + i);
+		}
+
+		__m128 l[PARTICLE_AFFINE_SIZE];
+		for (int r = 0; r < 4; r++) {
+			for (int c = 0; c < 3; c++) {
+				__m128 s = _mm_add_ps(_mm_add_ps(
+						_mm_mul_ps(pv[r * 3], mv[c]),
+						_mm_mul_ps(pv[r * 3 + 1], mv[3 + c])),
+						_mm_mul_ps(pv[r * 3 + 2], mv[6 + c]));
+				l[r * 3 + c] = r == 3 ? _mm_add_ps(s, mv[9 + c]) : s;
+			}
+		}
+		for (int k = 0; k < PARTICLE_AFFINE_SIZE; k++)
+			_mm_storeu_ps(p[k] + i, l[k]);
+		_mm_storeu_ps(z + i, l[11]);
+
+		/* Only x and y decide visibility, the quad is never stored */
+		__m128 hx[2], hy[2];
+		for (int c = 0; c < 2; c++) {
+			hx[c] = _mm_mul_ps(l[c], half);
+			hy[c] = _mm_mul_ps(l[3 + c], half);
+		}
+
+		__m128 in_view = zero;
+		for (int j = 0; j < 4; j++) {
+			__m128 co[2];
+			for (int c = 0; c < 2; c++) {
+				__m128 x = cornerSign[j][0] < 0 ? _mm_sub_ps(l[9 + c], hx[c]) : _mm_add_ps(l[9 + c], hx[c]);
+				co[c] = cornerSign[j][1] < 0 ? _mm_sub_ps(x, hy[c]) : _mm_add_ps(x, hy[c]);
+			}
+			in_view = _mm_or_ps(in_view, _mm_and_ps(
+					_mm_cmple_ps(_mm_and_ps(co[0], absMask), one),
+					_mm_cmple_ps(_mm_and_ps(co[1], absMask), one)));
+		}
+
+		int mask = _mm_movemask_ps(_mm_and_ps(in_view, _mm_cmpgt_ps(_mm_loadu_ps(alpha + i), zero)));
+		for (int k = 0; k < 4; k++)
+			visible[i + k] = (mask >> k) & 1;
+	}
+	return i;
+}
+#endif
+
+void particle_integrate(particleStorage &particles, size_t begin, size_t end, uint8_t *visible)
+{
+	float *p[PARTICLE_AFFINE_SIZE];
+	float *m[PARTICLE_AFFINE_SIZE];
+	for (size_t k = 0; k < PARTICLE_AFFINE_SIZE; k++) {
+		p[k] = particles.position[k].data();
+		m[k] = particles.transform[k].data();
+	}
+	float *z = particles.z.data();
+	const float *alpha = particles.alpha.data();
+
+#ifdef PARTICLES_SSE
+	begin = integrate_sse(p, m, z, alpha, visible, begin, end);
+#endif
+	integrate_scalar(p, m, z, alpha, visible, begin, end);
+}
+
+void particle_write_instances(const particleStorage &particles, const uint32_t *order, size_t begin, size_t end,
+		float *out, float *bounds)
+{
+	const std::vector<float> *p = particles.position;
+	const float *alpha = particles.alpha.data();
+	const float *lifeTime = particles.lifeTime.data();
+	const float *frame = particles.frame.data();
+	for (size_t i = begin; i < end; i++) {
+		uint32_t k = order[i];
+		float *o = &out[i * PARTICLE_INSTANCE_SIZE];
+		o[0] = p[9][k];
+		o[1] = p[10][k];
+		o[2] = p[11][k];
+		o[3] = alpha[k] / 255.0f;
+		o[4] = p[0][k];
+		o[5] = p[1][k];
+		o[6] = p[2][k];
+		o[7] = lifeTime[k];
+		o[8] = p[3][k];
+		o[9] = p[4][k];
+		o[10] = p[5][k];
+		o[11] = frame[k];
+	}
+	if (!bounds)
+		return;
+	for (size_t i = begin; i < end; i++) {
+		const float *o = &out[i * PARTICLE_INSTANCE_SIZE];
+		float ex = 0.5f * (fabsf(o[4]) + fabsf(o[8]));
+		float ey = 0.5f * (fabsf(o[5]) + fabsf(o[9]));
+		bounds[0] = std::min(bounds[0], o[0] - ex);
+		bounds[1] = std::min(bounds[1], o[1] - ey);
+		bounds[2] = std::max(bounds[2], o[0] + ex);
+		bounds[3] = std::max(bounds[3], o[1] + ey);
+	}
+}
+
+#define SORT_RADIX_BITS 11
+#define SORT_RADIX_SIZE (1 << SORT_RADIX_BITS)
+#define SORT_RADIX_PASSES 3
+
+/* Maps a float to an unsigned key whose ascending order is descending z */
+static inline uint32_t depth_key(float z)
+{
+	uint32_t bits;
+	z += 0.0f; /* -0 and 0 compare equal, give them the same key */
+	memcpy(&bits, &z, sizeof(bits));
+	bits = (bits & 0x80000000u) ? ~bits : (bits | 0x80000000u);
+	return ~bits;
+}
+
+void particle_sort_depth(const float *z, std::vector<uint32_t> &order, std::vector<particle_sort_key> &scratch)
+{
+	size_t count = order.size();
+	if (count < 2)
+		return;
+
+	if (count <= 64) {
+		/* Insertion sort is cheaper than the histogram passes for small sets */
+		for (size_t i = 1; i < count; i++) {
+			uint32_t index = order[i];
+			size_t j = i;
+			for (; j > 0 && z[order[j - 1]] < z[index]; j--)
+				order[j] = order[j - 1];
+			order[j] = index;
+		}
+		return;
+	}
+
+	scratch.resize(count * 2);
+	particle_sort_key *src = scratch.data();
+	particle_sort_key *dst = src + count;
+
+	uint32_t histogram[SORT_RADIX_PASSES][SORT_RADIX_SIZE];
+	memset(histogram, 0, sizeof(histogram));
+	for (size_t i = 0; i < count; i++) {
+		uint32_t key = depth_key(z[order[i]]);
+		src[i].key = key;
+		src[i].index = order[i];
+		for (int pass = 0; pass < SORT_RADIX_PASSES; pass++)
+			histogram[pass][(key >> (pass * SORT_RADIX_BITS)) & (SORT_RADIX_SIZE - 1)]++;
+	}
+
+	for (int pass = 0; pass < SORT_RADIX_PASSES; pass++) {
+		uint32_t *h = histogram[pass];
+		int shift = pass * SORT_RADIX_BITS;
+		/* Every key shares this digit, the pass would not move anything */
+		if (h[(src[0].key >> shift) & (SORT_RADIX_SIZE - 1)] == count)
+			continue;
+
+		uint32_t sum = 0;
+		for (size_t b = 0; b < SORT_RADIX_SIZE; b++) {
+			uint32_t c = h[b];
+			h[b] = sum;
+			sum += c;
+		}
+		for (size_t i = 0; i < count; i++)
+			dst[h[(src[i].key >> shift) & (SORT_RADIX_SIZE - 1)]++] = src[i];
+		std::swap(src, dst);
+	}
+
+	for (size_t i = 0; i < count; i++)
+		order[i] = src[i].index;
+}
+
+ParticleThreadPool::ParticleThreadPool(size_t threads)
+{
+	if (threads == 0)
+		threads = 1;
+	_slices.reset(new slice[threads]);
+	for (size_t i = 1; i < threads; i++)
+		_workers.emplace_back(&ParticleThreadPool::workerLoop, this, i);
+}
+
+ParticleThreadPool::~ParticleThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_stop = true;
+	}
+	_wake.notify_all();
+	for (std::thread &worker : _workers)
+		worker.join();
+}
+
+void ParticleThreadPool::run(size_t participant)
+{
+	size_t count = threads();
+	for (size_t k = 0; k < count; k++) {
+		/* Own slice first, then steal from the others */
+		slice &s = _slices[(participant + k) % count];
+		for (;;) {
+			size_t begin = s.next.fetch_add(_grain);
+			if (begin >= s.end)
+				break;
+			(*_fn)(begin, std::min(begin + _grain, s.end));
+		}
+	}
+}
+
+void ParticleThreadPool::workerLoop(size_t participant)
+{
+	uint64_t seen = 0;
+	for (;;) {
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			_wake.wait(lock, [&] {
+				return _stop || (_open && _generation != seen);
+			});
+			if (_stop)
+				return;
+			seen = _generation;
+			_inside++;
+		}
+		run(participant);
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_inside--;
+		}
+		_idle.notify_all();
+	}
+}
+
+void ParticleThreadPool::parallelFor(size_t count, size_t grain, const std::function<void(size_t, size_t)> &fn)
+{
+	if (count == 0)
+		return;
+	if (grain == 0)
+		grain = 1;
+	size_t participants = threads();
+	if (participants == 1 || count <= grain) {
+		fn(0, count);
+		return;
+	}
+
+	std::lock_guard<std::mutex> call(_call);
+	size_t per = (count + participants - 1) / participants;
+	for (size_t i = 0; i < participants; i++) {
+		size_t begin = std::min(i * per, count);
+		_slices[i].next.store(begin);
+		_slices[i].end = std::min(begin + per, count);
+	}
+	_fn = &fn;
+	_grain = grain;
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_open = true;
+		_generation++;
+	}
+	_wake.notify_all();
+
+	run(0);
+
+	/* Every chunk is claimed once run returns, wait for workers still executing one */
+	std::unique_lock<std::mutex> lock(_mutex);
+	_open = false;
+	_idle.wait(lock, [&] {
+		return _inside == 0;
+	});
+	_fn = nullptr;
+}
+
+void particle_fill_instances(ParticleThreadPool *pool, const particleStorage &particles, const uint32_t *order,
+		size_t count, size_t visible, float *out, float *bounds)
+{
+	bounds[0] = bounds[1] = FLT_MAX;
+	bounds[2] = bounds[3] = -FLT_MAX;
+	std::mutex boundsMutex;
+	pool->parallelFor(count, PARTICLE_CHUNK, [&](size_t begin, size_t end) {
+		/* Only visible particles, which lead the draw order, grow the bounding box */
+		size_t split = std::min(std::max(begin, visible), end);
+		float local[4] = { FLT_MAX, FLT_MAX, -FLT_MAX, -FLT_MAX };
+		particle_write_instances(particles, order, begin, split, out, local);
+		particle_write_instances(particles, order, split, end, out);
+		if (split == begin)
+			return;
+		std::lock_guard<std::mutex> lock(boundsMutex);
+		bounds[0] = std::min(bounds[0], local[0]);
+		bounds[1] = std::min(bounds[1], local[1]);
+		bounds[2] = std::max(bounds[2], local[2]);
+		bounds[3] = std::max(bounds[3], local[3]);
+	});
+}
+
+void particleGrid::build(const particleStorage &particles, float size)
+{
+	cellSize = size > 0.001f ? size : 0.001f;
+	cells = (int)ceilf(2.0f / cellSize) + 2;
+	size_t count = particles.size();
+	const float *px = particles.position[9].data();
+	const float *py = particles.position[10].data();
+
+	/* Counting sort by cell: histogram, exclusive prefix sum, scatter */
+	size_t total = (size_t)cells * (size_t)cells;
+	cellStart.assign(total + 1, 0);
+	cellOf.resize(count);
+	for (size_t i = 0; i < count; i++) {
+		uint32_t c = (uint32_t)(cell(py[i]) * cells + cell(px[i]));
+		cellOf[i] = c;
+		cellStart[c + 1]++;
+	}
+	for (size_t c = 0; c < total; c++)
+		cellStart[c + 1] += cellStart[c];
+
+	x.resize(count);
+	y.resize(count);
+	for (size_t i = 0; i < count; i++) {
+		uint32_t c = cellOf[i];
+		uint32_t slot = cellStart[c]++;
+		x[slot] = px[i];
+		y[slot] = py[i];
+	}
+	/* Scatter advanced every start to the next cell's, shift them back */
+	for (size_t c = total; c > 0; c--)
+		cellStart[c] = cellStart[c - 1];
+	cellStart[0] = 0;
+}
+
+size_t particleGrid::count(float px, float py, float radius) const
+{
+	if (cells == 0 || x.empty())
+		return 0;
+	float r2 = radius * radius;
+	int x0 = cell(px - radius), x1 = cell(px + radius);
+	int y0 = cell(py - radius), y1 = cell(py + radius);
+	size_t found = 0;
+	for (int cy = y0; cy <= y1; cy++) {
+		for (int cx = x0; cx <= x1; cx++) {
+			size_t c = (size_t)(cy * cells + cx);
+			for (uint32_t i = cellStart[c]; i < cellStart[c + 1]; i++) {
+				float dx = x[i] - px;
+				float dy = y[i] - py;
+				found += dx * dx + dy * dy <= r2;
+			}
+		}
+	}
+	return found;
+}
+
+void particleSystem::setCapacity(size_t capacity)
+{
+	particles.setCapacity(capacity);
+	expired.assign(capacity, 0);
+	visible.assign(capacity, 0);
+}
+
+bool particleSystem::spawn(const float *position, const float *transform, float alpha, float decay,
+		float localLife, float age, float frame, int frames)
+{
+	size_t slot = particles.spawn(alpha, decay, age, localLife);
+	if (slot == SIZE_MAX)
+		return false;
+	for (size_t k = 0; k < PARTICLE_AFFINE_SIZE; k++) {
+		particles.position[k][slot] = position[k];
+		particles.transform[k][slot] = transform[k];
+	}
+	particles.z[slot] = position[11];
+	/* Frames wrap around the atlas, the shader adds the animation */
+	frame = fmodf(floorf(frame), (float)frames);
+	particles.frame[slot] = frame < 0 ? frame + frames : frame;
+	return true;
+}
+
+void particleSystem::simulate(size_t begin, size_t end, float seconds, float rate)
+{
+	uint8_t *dead = expired.data();
+	uint8_t *inView = visible.data();
+	particle_age(particles, begin, end, seconds, rate, dead);
+	particle_integrate(particles, begin, end, inView);
+	for (size_t i = begin; i < end; i++)
+		dead[i] = (despawnOld && dead[i]) || (despawnOutOfView && !inView[i]);
+}
+
+void particleSystem::despawn(size_t begin)
+{
+	particles.removeWhere(expired.data(), 1, visible.data(), begin);
+}
+
+size_t particleSystem::drawOrder(std::vector<uint32_t> &order, std::vector<particle_sort_key> &scratch,
+		bool sort) const
+{
+	size_t count = particles.size();
+	order.clear();
+	order.reserve(count);
+	for (size_t i = 0; i < count; i++) {
+		if (visible[i])
+			order.push_back((uint32_t)i);
+	}
+	size_t visibleCount = order.size();
+	if (sort)
+		particle_sort_depth(particles.z.data(), order, scratch);
+	for (size_t i = 0; visibleCount != count && i < count; i++) {
+		if (!visible[i])
+			order.push_back((uint32_t)i);
+	}
+	return visibleCount;
+}
+
+void ParticleSimulation::add(particleSystem *system)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	if (std::find(_systems.begin(), _systems.end(), system) == _systems.end())
+		_systems.push_back(system);
+}
+
+void ParticleSimulation::remove(particleSystem *system)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	_systems.erase(std::remove(_systems.begin(), _systems.end(), system), _systems.end());
+}
+
+bool ParticleSimulation::step(uint64_t frame, float seconds, float rate)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	if (frame == _frame)
+		return false;
+	_frame = frame;
+
+	/* Every system's particles laid end to end as one range */
+	size_t systems = _systems.size();
+	_offsets.resize(systems + 1);
+	_offsets[0] = 0;
+	for (size_t s = 0; s < systems; s++) {
+		_offsets[s + 1] = _offsets[s] + _systems[s]->particles.size();
+	}
+
+	_pool->parallelFor(_offsets[systems], PARTICLE_CHUNK, [&](size_t begin, size_t end) {
+		size_t s = std::upper_bound(_offsets.begin(), _offsets.end(), begin) - _offsets.begin() - 1;
+		for (; begin < end; s++) {
+			size_t stop = std::min(end, _offsets[s + 1]);
+			if (stop > begin)
+				_systems[s]->simulate(begin - _offsets[s], stop - _offsets[s], seconds, rate);
+			begin = stop;
+		}
+	});
+	_pool->parallelFor(systems, 1, [&](size_t begin, size_t end) {
+		for (size_t s = begin; s < end; s++) {
+			_systems[s]->despawn();
+			if (_systems[s]->useGrid)
+				_systems[s]->grid.build(_systems[s]->particles, _systems[s]->grid.cellSize);
+		}
+	});
+	return true;
+}
@@ -0,0 +1,226 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <math.h>
+#include <vector>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+/* Affine transforms are stored as 3x4 row-vector matrices (rows x, y, z, then
+ * translation t) to match libobs' matrix4 convention, one float array per element */
+#define PARTICLE_AFFINE_SIZE 12
+/* Particles per chunk handed to a worker */
+#define PARTICLE_CHUNK 4096
+
+/* Particle state kept as parallel arrays so each pass only streams the fields it reads.
+ * Storage is a fixed-capacity pool, live particles are dense in [0, size()) and
+ * despawning swaps the last particle into the freed slot. */
+struct particleStorage {
+	std::vector<float> position[PARTICLE_AFFINE_SIZE];
+	std::vector<float> transform[PARTICLE_AFFINE_SIZE];
+	std::vector<float> z;
+	std::vector<float> decayAlpha;
+	std::vector<float> alpha;
+	std::vector<float> lifeTime;
+	std::vector<float> localLifeTime;
+	std::vector<float> frame;
+
+	size_t count = 0;
+
+	size_t size() const
+	{
+		return count;
+	}
+
+	size_t capacity() const
+	{
+		return alpha.size();
+	}
+
+	/* Allocates every array once, live particles are dropped */
+	void setCapacity(size_t capacity);
+	void clear()
+	{
+		count = 0;
+	}
+
+	/* Returns the new particle's slot, or SIZE_MAX when the pool is full */
+	size_t spawn(float a, float decay, float life, float localLife);
+	void move(size_t dst, size_t src);
+	void remove(size_t i)
+	{
+		move(i, --count);
+	}
+
+	/* Swap-removes particles in [begin, size()) whose flag equals value, flags
+	 * and the optional carried array are swapped along */
+	void removeWhere(uint8_t *flags, uint8_t value, uint8_t *carried = nullptr, size_t begin = 0);
+
+	/* Removes the victims particles with the largest lifetime, carried flags are swapped along */
+	void removeOldest(size_t victims, std::vector<uint32_t> &scratch, uint8_t *carried = nullptr);
+};
+
+/* Writes the 3x4 affine T(x, y, z) * R(axis, angle), R built the way libobs'
+ * matrix4_rotate_aa4f does (unnormalized axis, quaternion normalized on use) */
+void particle_affine_compose(float *out, float x, float y, float z, float ax, float ay, float az, float angle);
+
+/* Applies each particle's transform to its position over [begin, end), then
+ * writes the z sort key and whether the particle is visible (alpha > 0 and any
+ * corner of its unit quad inside clip space) */
+void particle_integrate(particleStorage &particles, size_t begin, size_t end, uint8_t *visible);
+
+/* Floats per particle in the instance stream: center.xyz and alpha, quad x axis
+ * and lifetime, quad y axis and sprite atlas frame */
+#define PARTICLE_INSTANCE_SIZE 12
+
+/* Writes the instance stream for draw slots [begin, end), slot i holds particle order[i].
+ * When bounds is given it is grown (min x, min y, max x, max y) to cover the quads written. */
+void particle_write_instances(const particleStorage &particles, const uint32_t *order, size_t begin, size_t end,
+		float *out, float *bounds = nullptr);
+
+/* Ages every particle over [begin, end): lifetime advances and alpha decays.
+ * When expired is given it flags particles that outlived their local lifetime. */
+void particle_age(particleStorage &particles, size_t begin, size_t end, float seconds, float rate,
+		uint8_t *expired);
+
+struct particle_sort_key {
+	uint32_t key;
+	uint32_t index;
+};
+
+/* Sorts the particle indices in order back to front (descending z) with a
+ * stable LSD radix sort on the float keys, scratch is reused between calls */
+void particle_sort_depth(const float *z, std::vector<uint32_t> &order, std::vector<particle_sort_key> &scratch);
+
+/* Worker threads shared by the particle systems that use it. parallelFor
+ * splits a range into one slice per participant, each participant claims
+ * grain sized chunks from its own slice and steals from the others once it
+ * runs dry. The calling thread participates and returns once all chunks ran. */
+class ParticleThreadPool {
+	struct slice {
+		std::atomic<size_t> next;
+		size_t end;
+	};
+
+	std::vector<std::thread> _workers;
+	std::mutex _call;
+	std::mutex _mutex;
+	std::condition_variable _wake;
+	std::condition_variable _idle;
+	bool _stop = false;
+	uint64_t _generation = 0;
+
+	/* Current job, only valid while _open is set */
+	const std::function<void(size_t, size_t)> *_fn = nullptr;
+	std::unique_ptr<slice[]> _slices;
+	size_t _grain = 0;
+	bool _open = false;
+	size_t _inside = 0;
+
+	void run(size_t participant);
+	void workerLoop(size_t participant);
+
+public:
+	ParticleThreadPool(size_t threads);
+	~ParticleThreadPool();
+
+	size_t threads() const
+	{
+		return _workers.size() + 1;
+	}
+
+	void parallelFor(size_t count, size_t grain, const std::function<void(size_t, size_t)> &fn);
+};
+
+/* Writes the instance stream for draw slots [0, count) on the pool, bounds is set
+ * (min x, min y, max x, max y) to cover the quads of the first visible slots */
+void particle_fill_instances(ParticleThreadPool *pool, const particleStorage &particles, const uint32_t *order,
+		size_t count, size_t visible, float *out, float *bounds);
+
+/* Uniform grid over particle centers in clip space, rebuilt with a counting
+ * sort. Cells cover [-1, 1] with one border row and column on every side
+ * catching particles outside the view. */
+struct particleGrid {
+	float                 cellSize = 0.1f;
+	int                   cells = 0;
+	std::vector<uint32_t> cellStart;
+	std::vector<uint32_t> cellOf;
+	std::vector<float>    x;
+	std::vector<float>    y;
+
+	void build(const particleStorage &particles, float size);
+	/* Particles whose center lies within radius of (px, py) */
+	size_t count(float px, float py, float radius) const;
+
+	inline int cell(float v) const
+	{
+		int c = (int)floorf((v + 1.0f) / cellSize) + 1;
+		return c < 0 ? 0 : (c >= cells ? cells - 1 : c);
+	}
+};
+
+/* What a neighbors() expression asks about, set while a particle spawns.
+ * Compiling a neighbors() call raises useGrid when it is set */
+struct particleQuery {
+	const particleGrid *grid;
+	float               x;
+	float               y;
+	bool               *useGrid;
+};
+
+/* A particle system's state as seen by the simulation. expired and visible
+ * hold per particle flags from the last step. */
+struct particleSystem {
+	particleStorage      particles;
+	std::vector<uint8_t> expired;
+	std::vector<uint8_t> visible;
+	bool                 despawnOld = true;
+	bool                 despawnOutOfView = true;
+	/* Only systems whose expressions compiled a neighbors() call pay for the grid */
+	bool                 useGrid = false;
+	particleGrid         grid;
+
+	void setCapacity(size_t capacity);
+	/* Stores a particle placed by position and moved by transform (3x4 affines) that
+	 * already lived age seconds, frame wraps around frames atlas cells.
+	 * Returns false when the pool is full. */
+	bool spawn(const float *position, const float *transform, float alpha, float decay, float localLife,
+			float age, float frame, int frames);
+	/* Ages and integrates [begin, end) then flags particles to despawn */
+	void simulate(size_t begin, size_t end, float seconds, float rate);
+	/* Removes particles flagged by simulate from begin onwards */
+	void despawn(size_t begin = 0);
+	/* Fills order with the visible particles, back to front when sort is set, followed
+	 * by the invisible ones. Returns the number of visible particles. */
+	size_t drawOrder(std::vector<uint32_t> &order, std::vector<particle_sort_key> &scratch, bool sort) const;
+};
+
+/* Steps every registered particle system with one dispatch on the pool, at
+ * most once per frame, instead of one dispatch per system. Grids are rebuilt
+ * after despawning. */
+class ParticleSimulation {
+	ParticleThreadPool *_pool;
+	std::mutex _mutex;
+	std::vector<particleSystem *> _systems;
+	std::vector<size_t> _offsets;
+	uint64_t _frame = UINT64_MAX;
+
+public:
+	ParticleSimulation(ParticleThreadPool *pool) : _pool(pool) {}
+
+	ParticleThreadPool *pool() const
+	{
+		return _pool;
+	}
+
+	void add(particleSystem *system);
+	void remove(particleSystem *system);
+
+	/* Returns false when frame was already stepped */
+	bool step(uint64_t frame, float seconds, float rate);
+};
@@ -81,6 +81,7 @@ typedef struct state {
 #define TYPE_MASK(TYPE) ((TYPE)&0x0000001F)
 
 #define IS_PURE(TYPE) (((TYPE) & TE_FLAG_PURE) != 0)
+#define IS_STATEFUL(TYPE) (((TYPE) & TE_FLAG_STATEFUL) != 0)
 #define IS_FUNCTION(TYPE) (((TYPE) & TE_FUNCTION0) != 0)
 #define IS_CLOSURE(TYPE) (((TYPE) & TE_CLOSURE0) != 0)
 #define ARITY(TYPE) ( ((TYPE) & (TE_FUNCTION0 | TE_CLOSURE0)) ? ((TYPE) & 0x00000007) : 0 )
@@ -247,6 +248,14 @@ static te_expr *list(state *s);
 static te_expr *expr(state *s);
 static te_expr *power(state *s);
 
+static void *call_site_context(const state *s)
+{
+	const te_state_allocator *a;
+	if (!IS_STATEFUL(s->type)) return s->context;
+	a = s->context;
+	return a ? a->alloc(a->arena, a->size) : 0;
+}
+
 static te_expr *base(state *s)
 {
 	/* <base>      =    <constant> | <variable> | <function-0> {"(" ")"} | <function-1> <power> | <function-X> "(" <expr> {"," <expr>} ")" | "(" <list> ")" */
@@ -270,7 +279,7 @@ static te_expr *base(state *s)
 	case TE_CLOSURE0:
 		ret = new_expr(s->type, 0);
 		ret->function = s->function;
-		if (IS_CLOSURE(s->type)) ret->parameters[0] = s->context;
+		if (IS_CLOSURE(s->type)) ret->parameters[0] = call_site_context(s);
 		next_token(s);
 		if (s->type == TOK_OPEN) {
 			next_token(s);
@@ -286,7 +295,7 @@ static te_expr *base(state *s)
 	case TE_CLOSURE1:
 		ret = new_expr(s->type, 0);
 		ret->function = s->function;
-		if (IS_CLOSURE(s->type)) ret->parameters[1] = s->context;
+		if (IS_CLOSURE(s->type)) ret->parameters[1] = call_site_context(s);
 		next_token(s);
 		ret->parameters[0] = power(s);
 		break;
@@ -299,7 +308,7 @@ static te_expr *base(state *s)
 
 		ret = new_expr(s->type, 0);
 		ret->function = s->function;
-		if (IS_CLOSURE(s->type)) ret->parameters[arity] = s->context;
+		if (IS_CLOSURE(s->type)) ret->parameters[arity] = call_site_context(s);
 		next_token(s);
 
 		if (s->type != TOK_OPEN) {
@@ -551,7 +560,7 @@ int compare_te_variables(const void *a, const void *b)
 	return strcmp(var_1->name, var_2->name);
 }
 
-te_expr *te_compile(const char *expression, const te_variable *variables, int var_count, int *error)
+static te_expr *parse(const char *expression, const te_variable *variables, int var_count, int *error)
 {
 	state s;
 	s.start = s.next = expression;
@@ -575,12 +584,228 @@ te_expr *te_compile(const char *expression, const te_variable *variables, int va
 		}
 		return 0;
 	} else {
-		optimize(root);
 		if (error) *error = 0;
 		return root;
 	}
 }
 
+te_expr *te_compile(const char *expression, const te_variable *variables, int var_count, int *error)
+{
+	te_expr *root = parse(expression, variables, var_count, error);
+	if (root) optimize(root);
+	return root;
+}
+
+
+int te_node_count(const te_expr *n)
+{
+	int i, count = 1;
+	if (!n) return 0;
+	if (IS_FUNCTION(n->type) || IS_CLOSURE(n->type))
+		for (i = 0; i < ARITY(n->type); i++) count += te_node_count(n->parameters[i]);
+	return count;
+}
+
+
+int te_is_stateful(const te_expr *n)
+{
+	int i;
+	if (!n) return 0;
+	if (IS_CLOSURE(n->type) && IS_STATEFUL(n->type)) return 1;
+	if (IS_FUNCTION(n->type) || IS_CLOSURE(n->type))
+		for (i = 0; i < ARITY(n->type); i++) if (te_is_stateful(n->parameters[i])) return 1;
+	return 0;
+}
+
+
+struct te_vector {
+	int count;
+	te_expr **components;
+
+	/* Subexpressions shared between components, evaluated once per te_eval_vector. */
+	int shared_count;
+	te_expr **shared;
+	double *values;
+};
+
+typedef struct cse_entry {
+	te_expr *node;
+	int slot;
+} cse_entry;
+
+typedef struct cse_state {
+	te_vector *v;
+	cse_entry *seen;
+	int seen_len;
+} cse_state;
+
+static int expr_size(int type)
+{
+	return (sizeof(te_expr) - sizeof(void*)) + sizeof(void*) * ARITY(type) + (IS_CLOSURE(type) ? sizeof(void*) : 0);
+}
+
+
+static int is_comma(const te_expr *n)
+{
+	return n->type == (TE_FUNCTION2 | TE_FLAG_PURE) && n->function == comma;
+}
+
+static int te_equal(const te_expr *a, const te_expr *b)
+{
+	int i, arity;
+	if (a->type != b->type) return 0;
+	if (a->type == TE_CONSTANT) return a->value == b->value;
+	if (a->type == TE_VARIABLE) return a->bound == b->bound;
+
+	/* Impure functions (random etc.) must be evaluated at each call site. */
+	if (!IS_PURE(a->type) || a->function != b->function) return 0;
+	arity = ARITY(a->type);
+	if (IS_CLOSURE(a->type) && a->parameters[arity] != b->parameters[arity]) return 0;
+	for (i = 0; i < arity; i++) {
+		if (!te_equal(a->parameters[i], b->parameters[i])) return 0;
+	}
+	return 1;
+}
+
+static void bind_slot(te_vector *v, te_expr *n, int slot)
+{
+	n->type = TE_VARIABLE;
+	n->bound = &v->values[slot];
+}
+
+static int hoist(te_vector *v, te_expr *n)
+{
+	const int size = expr_size(n->type);
+	te_expr *copy = malloc(size);
+	memcpy(copy, n, size);
+	v->shared[v->shared_count] = copy;
+	/* The copy now owns the parameters, turn the original into a slot read. */
+	bind_slot(v, n, v->shared_count);
+	return v->shared_count++;
+}
+
+static void cse(cse_state *c, te_expr *n)
+{
+	int i;
+	const int arity = ARITY(n->type);
+	if (!IS_FUNCTION(n->type) && !IS_CLOSURE(n->type)) return;
+
+	/* Post order, children are already canonical when the parent is compared. */
+	for (i = 0; i < arity; i++) cse(c, n->parameters[i]);
+
+	if (!IS_PURE(n->type) || arity == 0) return;
+
+	for (i = 0; i < c->seen_len; i++) {
+		cse_entry *e = &c->seen[i];
+		const te_expr *m = e->slot < 0 ? e->node : c->v->shared[e->slot];
+		if (te_equal(m, n)) {
+			if (e->slot < 0) e->slot = hoist(c->v, e->node);
+			te_free_parameters(n);
+			bind_slot(c->v, n, e->slot);
+			return;
+		}
+	}
+
+	c->seen[c->seen_len].node = n;
+	c->seen[c->seen_len].slot = -1;
+	c->seen_len++;
+}
+
+te_vector *te_compile_vector(const char *expression, const te_variable *variables, int var_count, int *error)
+{
+	te_expr *root = parse(expression, variables, var_count, error);
+	te_expr *n;
+	te_vector *v;
+	cse_state c;
+	int i, nodes = 0;
+
+	if (!root) return 0;
+
+	v = calloc(1, sizeof(te_vector));
+	v->count = 1;
+	for (n = root; is_comma(n); n = n->parameters[0]) v->count++;
+	v->components = malloc(sizeof(te_expr*) * v->count);
+
+	/* "(a, b, c)" parses as comma(comma(a, b), c), unroll the left spine. */
+	n = root;
+	for (i = v->count - 1; i > 0; i--) {
+		te_expr *next = n->parameters[0];
+		v->components[i] = n->parameters[1];
+		free(n);
+		n = next;
+	}
+	v->components[0] = n;
+
+	for (i = 0; i < v->count; i++) {
+		optimize(v->components[i]);
+		nodes += te_node_count(v->components[i]);
+	}
+
+	v->shared = malloc(sizeof(te_expr*) * nodes);
+	v->values = calloc(nodes, sizeof(double));
+
+	c.v = v;
+	c.seen = malloc(sizeof(cse_entry) * nodes);
+	c.seen_len = 0;
+	for (i = 0; i < v->count; i++) cse(&c, v->components[i]);
+	free(c.seen);
+
+	return v;
+}
+
+
+int te_eval_vector(const te_vector *v, double *out, int count)
+{
+	int i;
+	if (!v) return 0;
+
+	/* Slots are ordered so a shared expression only reads earlier slots. */
+	for (i = 0; i < v->shared_count; i++) v->values[i] = te_eval(v->shared[i]);
+
+	if (count > v->count) count = v->count;
+	for (i = 0; i < count; i++) out[i] = te_eval(v->components[i]);
+	return count;
+}
+
+
+int te_vector_size(const te_vector *v)
+{
+	return v ? v->count : 0;
+}
+
+
+int te_vector_node_count(const te_vector *v)
+{
+	int i, count = 0;
+	if (!v) return 0;
+	for (i = 0; i < v->count; i++) count += te_node_count(v->components[i]);
+	for (i = 0; i < v->shared_count; i++) count += te_node_count(v->shared[i]);
+	return count;
+}
+
+
+int te_vector_is_stateful(const te_vector *v)
+{
+	int i;
+	if (!v) return 0;
+	for (i = 0; i < v->count; i++) if (te_is_stateful(v->components[i])) return 1;
+	for (i = 0; i < v->shared_count; i++) if (te_is_stateful(v->shared[i])) return 1;
+	return 0;
+}
+
+
+void te_free_vector(te_vector *v)
+{
+	int i;
+	if (!v) return;
+	for (i = 0; i < v->count; i++) te_free(v->components[i]);
+	for (i = 0; i < v->shared_count; i++) te_free(v->shared[i]);
+	free(v->components);
+	free(v->shared);
+	free(v->values);
+	free(v);
+}
+
 
 double te_interp(const char *expression, int *error)
 {
@@ -25,6 +25,8 @@
 #ifndef __TINYEXPR_H__
 #define __TINYEXPR_H__
 
+#include <stddef.h>
+
 
 #ifdef __cplusplus
 extern "C" {
@@ -48,9 +50,20 @@ enum {
 	TE_CLOSURE0 = 16, TE_CLOSURE1, TE_CLOSURE2, TE_CLOSURE3,
 	TE_CLOSURE4, TE_CLOSURE5, TE_CLOSURE6, TE_CLOSURE7,
 
-	TE_FLAG_PURE = 32
+	TE_FLAG_PURE = 32, TE_FLAG_STATEFUL = 64
 };
 
+/* Closures flagged TE_FLAG_STATEFUL get their own state per call site. */
+/* Their context must point to a te_state_allocator, alloc is called once */
+/* per call site at compile time and its result is passed as the context. */
+typedef struct te_state_allocator {
+	void *(*alloc)(void *arena, size_t size);
+	void *arena;
+	size_t size;
+} te_state_allocator;
+
+typedef struct te_vector te_vector;
+
 typedef struct te_variable {
 	const char *name;
 	const void *address;
@@ -71,9 +84,38 @@ te_expr *te_compile(const char *expression, const te_variable *variables, int va
 /* Evaluates the expression. */
 double te_eval(const te_expr *n);
 
+/* Parses a comma separated list "(x, y, ...)" into one program with a */
+/* result per component. Pure subexpressions repeated across components */
+/* are evaluated once per te_eval_vector. */
+/* Returns NULL on error. */
+te_vector *te_compile_vector(const char *expression, const te_variable *variables, int var_count, int *error);
+
+/* Evaluates up to count components into out. */
+/* Returns the number of components written. */
+int te_eval_vector(const te_vector *v, double *out, int count);
+
+/* Returns the number of components in the program. */
+int te_vector_size(const te_vector *v);
+
+/* Returns the number of nodes in all components and shared subexpressions. */
+int te_vector_node_count(const te_vector *v);
+
+/* Returns non zero when any component calls a TE_FLAG_STATEFUL closure. */
+int te_vector_is_stateful(const te_vector *v);
+
+/* Frees the program. */
+/* This is safe to call on NULL pointers. */
+void te_free_vector(te_vector *v);
+
 /* Prints debugging information on the syntax tree. */
 void te_print(const te_expr *n);
 
+/* Returns the number of nodes in the syntax tree. */
+int te_node_count(const te_expr *n);
+
+/* Returns non zero when the tree calls a TE_FLAG_STATEFUL closure. */
+int te_is_stateful(const te_expr *n);
+
 /* Frees the expression. */
 /* This is safe to call on NULL pointers. */
 void te_free(te_expr *n);